@@ -3,103 +3,837 @@
 #include <sstream>
 #include <vector>
 #include <string>
+#include <cstring>
 #include <map>
+#include <set>
+#include <list>
 #include <algorithm>
+#include <limits>
+#include <climits>
 #include <ctime>    // For logging date/time
+#include <iomanip>
+#include <functional>
+#include <tuple>
+#include <thread>
+#include <charconv>
+#include <filesystem>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <string_view>
+#include <new>
+#include <memory>
+#include <csignal>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#define ftruncate _chsize
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DENSE_SSE2
+#endif
 
 using namespace std;
 
 // -----------------------------------------------------------------------------
-// Structure representing a supply record
+// Performance statistics. The hot paths are timed into latency histograms:
+// loading a city file, sorting, consolidating Metro Manila, searching,
+// allocating and committing the journal. A few event counters are kept too.
+// Every thread records into its own thread_local shard with plain relaxed
+// loads and stores (no locks and no read-modify-write instructions), and the
+// shards are only added up when the statistics are shown or saved. A thread's
+// shard is folded into the retired totals when the thread exits.
+// Histograms are HDR-style: one bucket range per power of two nanoseconds,
+// split into STATS_SUB_BUCKETS linear buckets, so every latency is kept to
+// within 1/STATS_SUB_BUCKETS of its value over the full 64-bit range. A
+// single search is too short to time cheaply, so searches are all counted
+// but only one in STATS_SEARCH_SAMPLE is timed.
+// Define RELIEF_NO_STATS to compile all of it out.
+// -----------------------------------------------------------------------------
+enum StatTimer {
+    STAT_LOAD, STAT_QUICK_SORT, STAT_MERGE_SORT, STAT_CONSOLIDATE, STAT_SEARCH, STAT_ALLOCATE,
+    STAT_JOURNAL_COMMIT, STAT_TIMER_COUNT
+};
+enum StatCounter { STAT_CITIES_EVICTED, STAT_JOURNAL_RECORDS, STAT_JOURNAL_BYTES, STAT_COUNTER_COUNT };
+const char *const STAT_TIMER_NAMES[STAT_TIMER_COUNT] = {
+    "load city file", "quick sort", "merge sort", "consolidate metro", "binary search", "allocate",
+    "journal commit"
+};
+const char *const STAT_COUNTER_NAMES[STAT_COUNTER_COUNT] = {
+    "cities evicted", "journal records", "journal bytes written"
+};
+const char STATS_FILE[] = "performance_stats.txt";
+bool saveStatsOnExit = false;
+
+#ifndef RELIEF_NO_STATS
+const int STATS_SUB_BITS = 3;
+const int STATS_SUB_BUCKETS = 1 << STATS_SUB_BITS;
+const int STATS_BUCKETS = (64 - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS;
+const unsigned STATS_SEARCH_SAMPLE = 16;
+
+typedef atomic<unsigned long long> StatCell;  // Written only by the thread that owns it.
+
+struct StatsCells {
+    StatCell counts[STAT_TIMER_COUNT] = {};       // Operations, timed or not.
+    StatCell totalNanos[STAT_TIMER_COUNT] = {};   // Sum of the timed latencies.
+    StatCell maxNanos[STAT_TIMER_COUNT] = {};
+    StatCell buckets[STAT_TIMER_COUNT][STATS_BUCKETS] = {};
+    StatCell counters[STAT_COUNTER_COUNT] = {};
+};
+
+inline void bumpStat(StatCell &cell, unsigned long long n) {
+    cell.store(cell.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Every live thread's shard, and the totals of threads that have exited. It
+// is never destroyed, so threads may still exit after main returns.
+struct StatsRegistry {
+    mutex lock;
+    vector<const StatsCells *> live;
+    StatsCells retired;
+};
+StatsRegistry &statsRegistry = *new StatsRegistry;
+
+void addStats(StatsCells &total, const StatsCells &shard) {
+    for (int t = 0; t < STAT_TIMER_COUNT; t++) {
+        bumpStat(total.counts[t], shard.counts[t].load(memory_order_relaxed));
+        bumpStat(total.totalNanos[t], shard.totalNanos[t].load(memory_order_relaxed));
+        unsigned long long shardMax = shard.maxNanos[t].load(memory_order_relaxed);
+        if (shardMax > total.maxNanos[t].load(memory_order_relaxed))
+            total.maxNanos[t].store(shardMax, memory_order_relaxed);
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            bumpStat(total.buckets[t][b], shard.buckets[t][b].load(memory_order_relaxed));
+    }
+    for (int c = 0; c < STAT_COUNTER_COUNT; c++)
+        bumpStat(total.counters[c], shard.counters[c].load(memory_order_relaxed));
+}
+
+struct ThreadStats : StatsCells {
+    unsigned sampleTick = 0;  // Operations since the last sampled one.
+    ThreadStats() {
+        lock_guard<mutex> guard(statsRegistry.lock);
+        statsRegistry.live.push_back(this);
+    }
+    ~ThreadStats() {
+        lock_guard<mutex> guard(statsRegistry.lock);
+        addStats(statsRegistry.retired, *this);
+        auto &live = statsRegistry.live;
+        live.erase(find(live.begin(), live.end(), this));
+    }
+};
+thread_local ThreadStats threadStats;
+
+int statsBucket(unsigned long long nanos) {
+    if (nanos < (unsigned long long)STATS_SUB_BUCKETS)
+        return (int)nanos;
+    int exponent = 63;
+    while (!(nanos >> exponent))
+        exponent--;
+    int sub = (int)(nanos >> (exponent - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return (exponent - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+// The middle of the latencies that fall in a bucket.
+double statsBucketValue(int bucket) {
+    if (bucket < STATS_SUB_BUCKETS)
+        return bucket;
+    int exponent = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    double width = ldexp(1.0, exponent - STATS_SUB_BITS);
+    return (STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) * width + (width - 1) / 2;
+}
+
+// Times the enclosing scope. With "sample" > 1, every operation is counted
+// but only one in "sample" is timed.
+class StatsScope {
+public:
+    explicit StatsScope(StatTimer timer, unsigned sample = 1) : timer(timer) {
+        ThreadStats &stats = threadStats;
+        bumpStat(stats.counts[timer], 1);
+        timed = (sample == 1 || ++stats.sampleTick % sample == 0);
+        if (timed)
+            start = chrono::steady_clock::now();
+    }
+    ~StatsScope() {
+        if (!timed)
+            return;
+        unsigned long long nanos = chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - start).count();
+        ThreadStats &stats = threadStats;
+        bumpStat(stats.totalNanos[timer], nanos);
+        bumpStat(stats.buckets[timer][statsBucket(nanos)], 1);
+        if (nanos > stats.maxNanos[timer].load(memory_order_relaxed))
+            stats.maxNanos[timer].store(nanos, memory_order_relaxed);
+    }
+private:
+    StatTimer timer;
+    bool timed;
+    chrono::steady_clock::time_point start;
+};
+
+#define STATS_JOIN2(a, b) a##b
+#define STATS_JOIN(a, b) STATS_JOIN2(a, b)
+#define STATS_TIME(timer) StatsScope STATS_JOIN(statsScope, __LINE__)(timer)
+#define STATS_TIME_SAMPLED(timer, sample) StatsScope STATS_JOIN(statsScope, __LINE__)(timer, sample)
+#define STATS_COUNT(counter, n) bumpStat(threadStats.counters[counter], (n))
+
+// The statistics of every thread so far, as a table.
+string formatStats() {
+    unique_ptr<StatsCells> total(new StatsCells());  // Too big for the stack.
+    {
+        lock_guard<mutex> guard(statsRegistry.lock);
+        addStats(*total, statsRegistry.retired);
+        for (const StatsCells *shard : statsRegistry.live)
+            addStats(*total, *shard);
+    }
+    ostringstream out;
+    out << fixed << setprecision(1);
+    out << "Latencies in microseconds (binary search: 1 in " << STATS_SEARCH_SAMPLE << " timed)\n";
+    out << left << setw(20) << "operation" << right << setw(10) << "count" << setw(11) << "mean"
+        << setw(11) << "p50" << setw(11) << "p90" << setw(11) << "p99" << setw(11) << "max" << "\n";
+    for (int t = 0; t < STAT_TIMER_COUNT; t++) {
+        unsigned long long timed = 0;
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            timed += total->buckets[t][b].load(memory_order_relaxed);
+        double maxMicros = total->maxNanos[t].load(memory_order_relaxed) / 1000.0;
+        out << left << setw(20) << STAT_TIMER_NAMES[t] << right << setw(10)
+            << total->counts[t].load(memory_order_relaxed) << setw(11)
+            << (timed ? total->totalNanos[t].load(memory_order_relaxed) / 1000.0 / timed : 0.0);
+        const double quantiles[] = {0.50, 0.90, 0.99};
+        for (double q : quantiles) {
+            unsigned long long rank = (unsigned long long)ceil(q * timed), seen = 0;
+            double value = 0;
+            for (int b = 0; b < STATS_BUCKETS && timed; b++) {
+                seen += total->buckets[t][b].load(memory_order_relaxed);
+                if (seen >= rank) {
+                    value = min(statsBucketValue(b) / 1000.0, maxMicros);
+                    break;
+                }
+            }
+            out << setw(11) << value;
+        }
+        out << setw(11) << maxMicros << "\n";
+    }
+    for (int c = 0; c < STAT_COUNTER_COUNT; c++)
+        out << STAT_COUNTER_NAMES[c] << ": " << total->counters[c].load(memory_order_relaxed) << "\n";
+    return out.str();
+}
+#else
+#define STATS_TIME(timer)
+#define STATS_TIME_SAMPLED(timer, sample)
+#define STATS_COUNT(counter, n)
+
+string formatStats() {
+    return "Performance statistics are not compiled in (built with RELIEF_NO_STATS).\n";
+}
+#endif
+
+// Writes the statistics, with the time they were taken, to STATS_FILE.
+bool saveStats() {
+    time_t now = time(0);
+    string text = string("Performance statistics at ") + ctime(&now) + formatStats();
+    ofstream outfile(STATS_FILE);
+    outfile << text;
+    return (bool)outfile;
+}
+
+// -----------------------------------------------------------------------------
+// Item name dictionary. Every item name is interned once and records refer to
+// it by a small integer id, so sorting and searching compare integers and a
+// record carries no strings. Ids are handed out in first-seen order, which is
+// not alphabetical: listings and text files are put in name order when they
+// are written (see byItemName). Interning may be called from loader threads.
+// -----------------------------------------------------------------------------
+typedef unsigned int ItemId;
+
+struct ItemDictionary {
+    deque<string> names;                     // Id -> name; a deque, so names never move.
+    unordered_map<string_view, ItemId> ids;  // Name -> id; the keys point into "names".
+    mutex lock;
+};
+ItemDictionary itemDictionary;
+
+ItemId internItem(string_view name) {
+    lock_guard<mutex> guard(itemDictionary.lock);
+    auto it = itemDictionary.ids.find(name);
+    if (it != itemDictionary.ids.end())
+        return it->second;
+    ItemId id = itemDictionary.names.size();
+    itemDictionary.names.emplace_back(name);
+    itemDictionary.ids.emplace(string_view(itemDictionary.names.back()), id);
+    return id;
+}
+
+// Looks an item up without interning it. Returns false for a name never seen.
+bool findItemId(string_view name, ItemId &id) {
+    lock_guard<mutex> guard(itemDictionary.lock);
+    auto it = itemDictionary.ids.find(name);
+    if (it == itemDictionary.ids.end())
+        return false;
+    id = it->second;
+    return true;
+}
+
+const string &itemName(ItemId id) {
+    return itemDictionary.names[id];
+}
+
+// -----------------------------------------------------------------------------
+// Item search index, for finding items by prefix (autocomplete) or by similar
+// spelling. It covers the whole dictionary; since the dictionary only grows,
+// each query first adds any names interned since the last one.
+//  - Prefix search: the ids sorted by name, so the names starting with a
+//    prefix are one contiguous range found with two binary searches.
+//  - Fuzzy search: a BK-tree over the names under edit (Levenshtein)
+//    distance. A node's children are keyed by their distance to it, so by the
+//    triangle inequality a query within distance k of the target only has to
+//    visit the children keyed d-k..d+k, where d is the query's distance to
+//    the node. Distances use Myers' bit-parallel algorithm, one machine word
+//    per text character, for query strings of up to 64 characters.
+// -----------------------------------------------------------------------------
+struct BKNode {
+    ItemId item;
+    vector<pair<int, unsigned int>> children;  // (distance to this node, node index).
+};
+
+struct ItemSearchIndex {
+    size_t indexed = 0;        // Dictionary ids below this are in the index.
+    vector<string_view> names; // Id -> name, copied under the dictionary's lock.
+    vector<ItemId> byName;     // Ids in alphabetical order of name.
+    vector<BKNode> tree;       // tree[0] is the root.
+};
+ItemSearchIndex itemSearch;
+
+// Edit distance from a pattern of up to 64 characters to "text". "peq" holds,
+// for every byte value, the bit mask of the pattern positions holding it.
+int myersDistance(const unsigned long long peq[256], size_t patternLength, string_view text) {
+    if (patternLength == 0)
+        return text.size();
+    unsigned long long pv = ~0ULL, mv = 0, last = 1ULL << (patternLength - 1);
+    int score = patternLength;
+    for (unsigned char c : text) {
+        unsigned long long eq = peq[c];
+        unsigned long long xv = eq | mv;
+        unsigned long long xh = (((eq & pv) + pv) ^ pv) | eq;
+        unsigned long long ph = mv | ~(xh | pv);
+        unsigned long long mh = pv & xh;
+        if (ph & last)
+            score++;
+        else if (mh & last)
+            score--;
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    return score;
+}
+
+// Edit distances from one string to many, using the bit-parallel algorithm
+// when the string fits in a word and the textbook dynamic program otherwise.
+class EditDistance {
+public:
+    explicit EditDistance(string_view pattern) : pattern(pattern) {
+        if (pattern.size() <= 64) {
+            memset(peq, 0, sizeof(peq));
+            for (size_t i = 0; i < pattern.size(); i++)
+                peq[(unsigned char)pattern[i]] |= 1ULL << i;
+        }
+    }
+    int to(string_view text) const {
+        if (pattern.size() <= 64)
+            return myersDistance(peq, pattern.size(), text);
+        vector<int> row(text.size() + 1);
+        for (size_t j = 0; j <= text.size(); j++)
+            row[j] = j;
+        for (size_t i = 1; i <= pattern.size(); i++) {
+            int diagonal = row[0];
+            row[0] = i;
+            for (size_t j = 1; j <= text.size(); j++) {
+                int above = row[j];
+                row[j] = min({above + 1, row[j - 1] + 1, diagonal + (pattern[i - 1] != text[j - 1])});
+                diagonal = above;
+            }
+        }
+        return row[text.size()];
+    }
+private:
+    string_view pattern;
+    unsigned long long peq[256];
+};
+
+// Loader threads may be interning names meanwhile, so the new names are
+// taken under the dictionary's lock. They never move once interned.
+void refreshItemSearchIndex() {
+    {
+        lock_guard<mutex> guard(itemDictionary.lock);
+        for (size_t id = itemSearch.names.size(); id < itemDictionary.names.size(); id++)
+            itemSearch.names.push_back(itemDictionary.names[id]);
+    }
+    const vector<string_view> &names = itemSearch.names;
+    size_t total = names.size();
+    if (itemSearch.indexed == total)
+        return;
+    auto byName = [&names](ItemId a, ItemId b) { return names[a] < names[b]; };
+    size_t oldCount = itemSearch.byName.size();
+    for (ItemId id = itemSearch.indexed; id < total; id++)
+        itemSearch.byName.push_back(id);
+    sort(itemSearch.byName.begin() + oldCount, itemSearch.byName.end(), byName);
+    inplace_merge(itemSearch.byName.begin(), itemSearch.byName.begin() + oldCount, itemSearch.byName.end(), byName);
+
+    for (ItemId id = itemSearch.indexed; id < total; id++) {
+        if (itemSearch.tree.empty()) {
+            itemSearch.tree.push_back({id, {}});
+            continue;
+        }
+        EditDistance distance(names[id]);
+        unsigned int node = 0;
+        while (true) {
+            int d = distance.to(names[itemSearch.tree[node].item]);
+            auto &children = itemSearch.tree[node].children;
+            auto child = find_if(children.begin(), children.end(),
+                                 [d](const pair<int, unsigned int> &c) { return c.first == d; });
+            if (child == children.end()) {
+                children.push_back({d, (unsigned int)itemSearch.tree.size()});
+                itemSearch.tree.push_back({id, {}});
+                break;
+            }
+            node = child->second;
+        }
+    }
+    itemSearch.indexed = total;
+}
+
+// Ids of the items whose names start with "prefix", alphabetically.
+vector<ItemId> itemsWithPrefix(string_view prefix) {
+    refreshItemSearchIndex();
+    const vector<ItemId> &ids = itemSearch.byName;
+    const vector<string_view> &names = itemSearch.names;
+    auto first = lower_bound(ids.begin(), ids.end(), prefix, [&names](ItemId id, string_view p) {
+        return names[id].substr(0, p.size()) < p;
+    });
+    auto last = upper_bound(first, ids.end(), prefix, [&names](string_view p, ItemId id) {
+        return p < names[id].substr(0, p.size());
+    });
+    return vector<ItemId>(first, last);
+}
+
+// (distance, id) of the items within "maxDistance" edits of "text", closest
+// first and then alphabetically.
+vector<pair<int, ItemId>> itemsNear(string_view text, int maxDistance) {
+    refreshItemSearchIndex();
+    vector<pair<int, ItemId>> found;
+    if (itemSearch.tree.empty())
+        return found;
+    const vector<string_view> &names = itemSearch.names;
+    EditDistance distance(text);
+    vector<unsigned int> pending(1, 0);
+    while (!pending.empty()) {
+        const BKNode &node = itemSearch.tree[pending.back()];
+        pending.pop_back();
+        int d = distance.to(names[node.item]);
+        if (d <= maxDistance)
+            found.push_back({d, node.item});
+        for (auto &child : node.children) {
+            if (child.first >= d - maxDistance && child.first <= d + maxDistance)
+                pending.push_back(child.second);
+        }
+    }
+    sort(found.begin(), found.end(), [&names](const pair<int, ItemId> &a, const pair<int, ItemId> &b) {
+        return a.first != b.first ? a.first < b.first : names[a.second] < names[b.second];
+    });
+    return found;
+}
+
+// How many edits a fuzzy search allows: short names change meaning quickly.
+int fuzzyTolerance(string_view text) {
+    return text.size() <= 4 ? 1 : 2;
+}
+
+// -----------------------------------------------------------------------------
+// Structure representing a supply record. The city is not stored: it is the
+// key the record is filed under in cityData (or Metro Manila).
 // -----------------------------------------------------------------------------
 struct Supply {
-    string city;      // For city datasets; for the consolidated Metro Manila dataset, this is a placeholder.
-    string itemName;  // Supply item name (e.g., "canned_goods")
+    ItemId itemId;    // Interned item name (e.g., "canned_goods"); see itemName().
     int quantity;     // Quantity available
 };
 
-// Comparator used for sorting supplies by itemName.
+// A single allocation: "quantity" of "item" moved from "donor" to "recipient".
+struct Transaction {
+    string donor;
+    string recipient;
+    string item;
+    int quantity;        // Negative for the cancellation of a transfer between shards.
+    long long time = 0;  // When it was logged (seconds since the epoch).
+    string transfer{};   // Id of the transfer between shards it belongs to, if any.
+};
+
+Transaction makeTransaction(const string &donor, const string &recipient, const string &item, int quantity) {
+    Transaction t;
+    t.donor = donor;
+    t.recipient = recipient;
+    t.item = item;
+    t.quantity = quantity;
+    return t;
+}
+
+// Comparator used for sorting supplies by item id.
 bool compareSupply(const Supply &a, const Supply &b) {
-    if (a.city != b.city)
-        return a.city < b.city;
-    return a.itemName < b.itemName;
+    return a.itemId < b.itemId;
+}
+
+// Returns the records in alphabetical order of item name, for listings and
+// text files.
+vector<const Supply*> byItemName(const vector<Supply> &supplies) {
+    vector<const Supply*> ordered;
+    ordered.reserve(supplies.size());
+    for (auto &s : supplies)
+        ordered.push_back(&s);
+    sort(ordered.begin(), ordered.end(), [](const Supply *a, const Supply *b) {
+        return itemName(a->itemId) < itemName(b->itemId);
+    });
+    return ordered;
 }
 
+// Registry entry for a city, kept whether or not its records are loaded.
+struct CityInfo {
+    bool resident = false;        // Its records are loaded in cityData.
+    bool dirty = false;           // Loaded records differ from its saved copy.
+    bool inSnapshot = false;      // Its saved copy is in the inventory snapshot...
+    size_t snapshotOffset = 0;    // ...at this offset...
+    size_t snapshotLength = 0;    // ...with this length; otherwise it is <city>.txt.
+    size_t itemCount = 0;         // Summary, kept up to date while evicted.
+    long long totalUnits = 0;
+    size_t residentBytes = 0;     // Estimated memory used by the loaded records.
+    list<string>::iterator lruPosition;
+};
+
 // Global data structures
-map<string, vector<Supply>> cityData;   // Each city's dataset.
+map<string, vector<Supply>> cityData;   // Datasets of the cities currently loaded.
 vector<Supply> metroManilaData;           // Consolidated Metro Manila dataset.
+vector<set<pair<int, string>>> donorIndex;  // Item id -> (quantity, city), ordered by quantity.
+map<string, CityInfo> cityRegistry;     // Every registered city.
+list<string> residentCities;            // Loaded cities, most recently used first.
+size_t cityMemoryBudget = 64 << 20;     // Bytes of city records to keep loaded.
+size_t cityMemoryUsed = 0;
+bool serviceRunning = false;            // Set while the allocation service has worker threads.
 
 // -----------------------------------------------------------------------------
-// Quick Sort (for sorting an individual city's dataset by itemName)
+// Quick Sort (for sorting an individual city's dataset by item id)
+// Implemented as an introsort: median-of-three (ninther for large ranges)
+// pivots, three-way partitioning so duplicate names are settled in one pass,
+// insertion sort for small ranges and a heapsort fallback when the recursion
+// gets too deep. The input is a city file's records in file order. Files are
+// saved in item name order and item ids are handed out as names are first
+// read, so that order usually matches id order; ranges that are already
+// sorted are detected and returned in linear time.
 // -----------------------------------------------------------------------------
-int partition(vector<Supply>& arr, int low, int high) {
-    Supply pivot = arr[high];
-    int i = low - 1;
-    for (int j = low; j < high; j++) {
-        if (arr[j].itemName < pivot.itemName) {
+const int INSERTION_SORT_CUTOFF = 16;  // Ranges this small go to insertion sort.
+const int NINTHER_CUTOFF = 128;        // Ranges this large use a ninther pivot.
+
+void insertionSort(vector<Supply>& arr, int low, int high) {
+    for (int i = low + 1; i <= high; i++) {
+        Supply key = move(arr[i]);
+        int j = i - 1;
+        while (j >= low && key.itemId < arr[j].itemId) {
+            arr[j + 1] = move(arr[j]);
+            j--;
+        }
+        arr[j + 1] = move(key);
+    }
+}
+
+void siftDown(vector<Supply>& arr, int low, int root, int size) {
+    while (true) {
+        int largest = root;
+        int left = 2 * root + 1, right = left + 1;
+        if (left < size && arr[low + largest].itemId < arr[low + left].itemId)
+            largest = left;
+        if (right < size && arr[low + largest].itemId < arr[low + right].itemId)
+            largest = right;
+        if (largest == root)
+            return;
+        swap(arr[low + root], arr[low + largest]);
+        root = largest;
+    }
+}
+
+void heapSort(vector<Supply>& arr, int low, int high) {
+    int size = high - low + 1;
+    for (int i = size / 2 - 1; i >= 0; i--)
+        siftDown(arr, low, i, size);
+    for (int end = size - 1; end > 0; end--) {
+        swap(arr[low], arr[low + end]);
+        siftDown(arr, low, 0, end);
+    }
+}
+
+// Returns the index of the median of arr[a], arr[b] and arr[c] by item id.
+int medianOfThree(const vector<Supply>& arr, int a, int b, int c) {
+    ItemId x = arr[a].itemId, y = arr[b].itemId, z = arr[c].itemId;
+    if (x < y) {
+        if (y < z) return b;
+        return (x < z) ? c : a;
+    }
+    if (x < z) return a;
+    return (y < z) ? c : b;
+}
+
+int choosePivot(const vector<Supply>& arr, int low, int high) {
+    int mid = low + (high - low) / 2;
+    if (high - low + 1 < NINTHER_CUTOFF)
+        return medianOfThree(arr, low, mid, high);
+    int step = (high - low + 1) / 8;
+    int m1 = medianOfThree(arr, low, low + step, low + 2 * step);
+    int m2 = medianOfThree(arr, mid - step, mid, mid + step);
+    int m3 = medianOfThree(arr, high - 2 * step, high - step, high);
+    return medianOfThree(arr, m1, m2, m3);
+}
+
+// Three-way (Dijkstra) partition around arr[pivotIndex]. On return,
+// arr[low..lt-1] < pivot, arr[lt..gt] == pivot and arr[gt+1..high] > pivot.
+void partitionThreeWay(vector<Supply>& arr, int low, int high, int pivotIndex, int &lt, int &gt) {
+    swap(arr[low], arr[pivotIndex]);
+    ItemId pivot = arr[low].itemId;
+    lt = low;
+    gt = high;
+    int i = low + 1;
+    while (i <= gt) {
+        if (arr[i].itemId < pivot)
+            swap(arr[lt++], arr[i++]);
+        else if (pivot < arr[i].itemId)
+            swap(arr[i], arr[gt--]);
+        else
             i++;
-            swap(arr[i], arr[j]);
+    }
+}
+
+// Handles ranges that are already ascending or strictly descending in one pass.
+// Returns true if the range is now sorted.
+bool sortIfMonotonic(vector<Supply>& arr, int low, int high) {
+    bool ascending = true, descending = true;
+    for (int i = low; i < high && (ascending || descending); i++) {
+        if (arr[i + 1].itemId < arr[i].itemId)
+            ascending = false;
+        if (!(arr[i + 1].itemId < arr[i].itemId))
+            descending = false;
+    }
+    if (descending)
+        reverse(arr.begin() + low, arr.begin() + high + 1);
+    return ascending || descending;
+}
+
+void introSort(vector<Supply>& arr, int low, int high, int depthLimit) {
+    while (high - low + 1 > INSERTION_SORT_CUTOFF) {
+        if (depthLimit == 0) {
+            heapSort(arr, low, high);
+            return;
+        }
+        depthLimit--;
+        int lt, gt;
+        partitionThreeWay(arr, low, high, choosePivot(arr, low, high), lt, gt);
+        // Recurse into the smaller side and loop on the larger one so the
+        // stack depth stays logarithmic.
+        if (lt - low < high - gt) {
+            introSort(arr, low, lt - 1, depthLimit);
+            low = gt + 1;
+        } else {
+            introSort(arr, gt + 1, high, depthLimit);
+            high = lt - 1;
         }
     }
-    swap(arr[i + 1], arr[high]);
-    return i + 1;
+    if (low < high)
+        insertionSort(arr, low, high);
 }
 
 void quickSort(vector<Supply>& arr, int low, int high) {
-    if (low < high) {
-        int pi = partition(arr, low, high);
-        quickSort(arr, low, pi - 1);
-        quickSort(arr, pi + 1, high);
-    }
+    STATS_TIME(STAT_QUICK_SORT);
+    if (low >= high)
+        return;
+    if (sortIfMonotonic(arr, low, high))
+        return;
+    int depthLimit = 0;
+    for (int n = high - low + 1; n > 1; n >>= 1)
+        depthLimit += 2;
+    introSort(arr, low, high, depthLimit);
 }
 
 // -----------------------------------------------------------------------------
 // Merge Sort (for sorting the consolidated Metro Manila dataset)
 // -----------------------------------------------------------------------------
-void merge(vector<Supply>& arr, int l, int m, int r) {
-    int n1 = m - l + 1, n2 = r - m;
-    vector<Supply> L(n1), R(n2);
-    for (int i = 0; i < n1; i++)
-        L[i] = arr[l + i];
-    for (int j = 0; j < n2; j++)
-        R[j] = arr[m + 1 + j];
-    int i = 0, j = 0, k = l;
-    while (i < n1 && j < n2) {
-        if (compareSupply(L[i], R[j])) {
-            arr[k++] = L[i++];
+// Both halves are moved into one scratch buffer owned by the caller, so a whole
+// sort allocates once instead of twice per recursion level.
+void merge(vector<Supply>& arr, int l, int m, int r, vector<Supply>& scratch) {
+    for (int i = l; i <= r; i++)
+        scratch[i] = move(arr[i]);
+    int i = l, j = m + 1, k = l;
+    while (i <= m && j <= r) {
+        if (compareSupply(scratch[j], scratch[i])) {
+            arr[k++] = move(scratch[j++]);
         } else {
-            arr[k++] = R[j++];
+            arr[k++] = move(scratch[i++]);
         }
     }
-    while (i < n1) {
-        arr[k++] = L[i++];
+    while (i <= m) {
+        arr[k++] = move(scratch[i++]);
     }
-    while (j < n2) {
-        arr[k++] = R[j++];
+    while (j <= r) {
+        arr[k++] = move(scratch[j++]);
     }
 }
 
-void mergeSort(vector<Supply>& arr, int l, int r) {
+void mergeSortRange(vector<Supply>& arr, int l, int r, vector<Supply>& scratch) {
     if (l < r) {
         int m = l + (r - l) / 2;
-        mergeSort(arr, l, m);
-        mergeSort(arr, m + 1, r);
-        merge(arr, l, m, r);
+        mergeSortRange(arr, l, m, scratch);
+        mergeSortRange(arr, m + 1, r, scratch);
+        if (compareSupply(arr[m + 1], arr[m]))
+            merge(arr, l, m, r, scratch);
     }
 }
 
+void mergeSort(vector<Supply>& arr, int l, int r) {
+    STATS_TIME(STAT_MERGE_SORT);
+    if (l >= r)
+        return;
+    vector<Supply> scratch(arr.size());
+    mergeSortRange(arr, l, r, scratch);
+}
+
+// -----------------------------------------------------------------------------
+// K-way merge of sorted city runs (for consolidating the Metro Manila dataset)
+// Every city vector is kept sorted by item id, so the consolidated dataset is
+// one streaming pass over a min-heap of run cursors that sums equal items.
+// -----------------------------------------------------------------------------
+const size_t PARALLEL_MERGE_MIN_RUNS = 64;
+
+struct RunCursor {
+    const Supply* next;
+    const Supply* end;
+};
+
+// Min-heap order on the item id under each cursor.
+bool cursorAfter(const RunCursor& a, const RunCursor& b) {
+    return a.next->itemId > b.next->itemId;
+}
+
+// Merges runs [first, last) into out starting at out[0]; equal items are
+// summed into a single record. Returns the number of records written.
+size_t mergeRuns(const vector<pair<const Supply*, const Supply*>>& runs, size_t first, size_t last,
+                 Supply* out) {
+    vector<RunCursor> heap;
+    heap.reserve(last - first);
+    for (size_t i = first; i < last; i++) {
+        if (runs[i].first != runs[i].second)
+            heap.push_back({runs[i].first, runs[i].second});
+    }
+    make_heap(heap.begin(), heap.end(), cursorAfter);
+
+    size_t written = 0;
+    while (!heap.empty()) {
+        pop_heap(heap.begin(), heap.end(), cursorAfter);
+        RunCursor& cursor = heap.back();
+        const Supply& s = *cursor.next;
+        if (written > 0 && out[written - 1].itemId == s.itemId) {
+            out[written - 1].quantity += s.quantity;
+        } else {
+            out[written++] = s;
+        }
+        if (++cursor.next == cursor.end) {
+            heap.pop_back();
+        } else {
+            push_heap(heap.begin(), heap.end(), cursorAfter);
+        }
+    }
+    return written;
+}
+
+// Scratch space for the parallel tree merge, kept between rebuilds.
+vector<Supply> consolidationScratch;
+
+// Consolidates sorted runs into out. Small inputs use a single heap merge; with
+// many runs, worker threads each merge a contiguous group of runs into their
+// own slice of the scratch buffer, and the partial results are merged at the end.
+void consolidateRuns(const vector<pair<const Supply*, const Supply*>>& runs, vector<Supply>& out) {
+    size_t total = 0;
+    for (auto &run : runs)
+        total += run.second - run.first;
+
+    unsigned workers = max(1u, thread::hardware_concurrency());
+    if (runs.size() < PARALLEL_MERGE_MIN_RUNS || workers == 1) {
+        out.resize(total);
+        out.resize(mergeRuns(runs, 0, runs.size(), out.data()));
+        return;
+    }
+
+    size_t groups = min<size_t>(workers, runs.size() / 2);
+    vector<size_t> groupStart(groups + 1);
+    vector<size_t> sliceStart(groups + 1, 0);
+    for (size_t g = 0; g <= groups; g++)
+        groupStart[g] = runs.size() * g / groups;
+    for (size_t g = 0; g < groups; g++) {
+        size_t records = 0;
+        for (size_t i = groupStart[g]; i < groupStart[g + 1]; i++)
+            records += runs[i].second - runs[i].first;
+        sliceStart[g + 1] = sliceStart[g] + records;
+    }
+
+    if (consolidationScratch.size() < total)
+        consolidationScratch.resize(total);
+    vector<size_t> sliceLength(groups, 0);
+    vector<thread> pool;
+    for (size_t g = 0; g < groups; g++) {
+        pool.emplace_back([&, g]() {
+            sliceLength[g] = mergeRuns(runs, groupStart[g], groupStart[g + 1],
+                                       consolidationScratch.data() + sliceStart[g]);
+        });
+    }
+    for (auto &t : pool)
+        t.join();
+
+    vector<pair<const Supply*, const Supply*>> partial;
+    for (size_t g = 0; g < groups; g++) {
+        const Supply* begin = consolidationScratch.data() + sliceStart[g];
+        partial.push_back({begin, begin + sliceLength[g]});
+    }
+    out.resize(sliceStart[groups]);
+    out.resize(mergeRuns(partial, 0, partial.size(), out.data()));
+}
+
 // -----------------------------------------------------------------------------
-// Binary Search: Searches a sorted vector of Supply records for a given item name.
+// Binary Search: Searches a sorted vector of Supply records for a given item.
 // Returns the index if found, or -1 if not found.
 // -----------------------------------------------------------------------------
-int binarySearch(const vector<Supply>& arr, const string &key) {
+int binarySearch(const vector<Supply>& arr, ItemId key) {
+    STATS_TIME_SAMPLED(STAT_SEARCH, STATS_SEARCH_SAMPLE);
     int left = 0;
     int right = arr.size() - 1;
     while (left <= right) {
         int mid = left + (right - left) / 2;
-        if (arr[mid].itemName == key)
+        if (arr[mid].itemId == key)
             return mid;
-        else if (arr[mid].itemName < key)
+        else if (arr[mid].itemId < key)
             left = mid + 1;
         else
             right = mid - 1;
@@ -107,90 +841,963 @@ int binarySearch(const vector<Supply>& arr, const string &key) {
     return -1;
 }
 
+int binarySearch(const vector<Supply>& arr, const string &key) {
+    ItemId id;
+    return findItemId(key, id) ? binarySearch(arr, id) : -1;
+}
+
+// -----------------------------------------------------------------------------
+// City item index. Every city's dataset in cityData is kept sorted by item id
+// at all times, so lookups are a binary search on the stored vector (no copy,
+// no re-sort) and new items are inserted directly at their sorted position.
+// -----------------------------------------------------------------------------
+Supply* findSupply(vector<Supply>& supplies, ItemId item) {
+    int index = binarySearch(supplies, item);
+    return (index != -1) ? &supplies[index] : nullptr;
+}
+
+Supply* findSupply(vector<Supply>& supplies, const string &item) {
+    int index = binarySearch(supplies, item);
+    return (index != -1) ? &supplies[index] : nullptr;
+}
+
+Supply& insertSupply(vector<Supply>& supplies, ItemId item, int quantity) {
+    Supply s;
+    s.itemId = item;
+    s.quantity = quantity;
+    auto pos = lower_bound(supplies.begin(), supplies.end(), s, compareSupply);
+    return *supplies.insert(pos, s);
+}
+
 // -----------------------------------------------------------------------------
 // Utility: Update the "registered_cities.txt" file based on the in-memory data.
 // -----------------------------------------------------------------------------
 void updateRegisteredCitiesFile() {
     ofstream outfile("registered_cities.txt");
     if (outfile) {
-        for (auto &entry : cityData) {
+        for (auto &entry : cityRegistry) {
             outfile << entry.first << "\n";
         }
         outfile.close();
     }
 }
 
+// -----------------------------------------------------------------------------
+// Metro Manila file persistence. metroManilaData is kept live in memory; the
+// file is only rewritten when changes are pending, and those writes are
+// coalesced: every METRO_FLUSH_INTERVAL changes, on an explicit save and on exit.
+// -----------------------------------------------------------------------------
+const int METRO_FLUSH_INTERVAL = 50;
+atomic<int> metroPendingChanges(0);  // Changes to metroManilaData not yet in metro_manila.txt.
+
+void saveMetroManilaFile() {
+    ofstream outfile("metro_manila.txt");
+    if (outfile) {
+        for (const Supply *s : byItemName(metroManilaData)) {
+            outfile << itemName(s->itemId) << " " << s->quantity << "\n";
+        }
+        outfile.close();
+    }
+    metroPendingChanges = 0;
+}
+
+// Writes metro_manila.txt if changes are pending. Unless forced, waits until
+// METRO_FLUSH_INTERVAL changes have accumulated.
+void flushMetroManilaData(bool force) {
+    if (metroPendingChanges == 0)
+        return;
+    if (force || metroPendingChanges >= METRO_FLUSH_INTERVAL)
+        saveMetroManilaFile();
+}
+
 // -----------------------------------------------------------------------------
 // Utility: Consolidate all city supplies into a single Metro Manila dataset.
-// For each unique item, sums quantities from all cities, then sorts and saves the data.
+// Merges the already-sorted city vectors in one pass, summing each item across
+// cities, then saves the data. This is the full rebuild used at startup; later
+// changes go through applyMetroDelta.
 // -----------------------------------------------------------------------------
 void updateMetroManilaData() {
-    map<string, int> consolidated;
+    STATS_TIME(STAT_CONSOLIDATE);
+    vector<pair<const Supply*, const Supply*>> runs;
+    runs.reserve(cityData.size());
     for (auto &entry : cityData) {
-        for (auto &supply : entry.second) {
-            consolidated[supply.itemName] += supply.quantity;
-        }
+        const vector<Supply>& supplies = entry.second;
+        runs.push_back({supplies.data(), supplies.data() + supplies.size()});
+    }
+    consolidateRuns(runs, metroManilaData);
+
+    saveMetroManilaFile();
+}
+
+// -----------------------------------------------------------------------------
+// Utility: Patch the live Metro Manila aggregate after a city's quantity of
+// "item" changed by "delta". Finds the item by binary search; an item that is
+// new to Metro Manila is inserted at its sorted position.
+// -----------------------------------------------------------------------------
+void applyMetroDelta(ItemId item, int delta) {
+    if (delta == 0)
+        return;
+    int index = binarySearch(metroManilaData, item);
+    if (index != -1) {
+        metroManilaData[index].quantity += delta;
+    } else {
+        insertSupply(metroManilaData, item, delta);
+    }
+    metroPendingChanges++;
+}
+
+// -----------------------------------------------------------------------------
+// Donor index: for every item, the cities holding it ordered by quantity.
+// "All donors with at least Q" is a lower_bound range query and "top k donors"
+// reads the k largest entries, without touching any city dataset.
+// The index is a vector indexed by item id; donorHolders grows it as items
+// are interned.
+// -----------------------------------------------------------------------------
+set<pair<int, string>>& donorHolders(ItemId item) {
+    if (item >= donorIndex.size())
+        donorIndex.resize(item + 1);
+    return donorIndex[item];
+}
+
+void addCityToDonorIndex(const string &city, const vector<Supply> &supplies) {
+    for (auto &s : supplies) {
+        donorHolders(s.itemId).insert({s.quantity, city});
+    }
+}
+
+void rebuildDonorIndex() {
+    donorIndex.clear();
+    for (auto &entry : cityData) {
+        addCityToDonorIndex(entry.first, entry.second);
     }
+}
+
+// Recomputes the Metro Manila totals from the donor index, which holds every
+// city's quantity of every item even when the city's records are not loaded.
+void rebuildMetroFromDonorIndex() {
+    STATS_TIME(STAT_CONSOLIDATE);
     metroManilaData.clear();
-    for (auto &entry : consolidated) {
+    for (ItemId item = 0; item < donorIndex.size(); item++) {
+        if (donorIndex[item].empty())
+            continue;
         Supply s;
-        s.city = "MetroManila"; // Placeholder.
-        s.itemName = entry.first;
-        s.quantity = entry.second;
+        s.itemId = item;
+        s.quantity = 0;
+        for (auto &holder : donorIndex[item])
+            s.quantity += holder.first;
         metroManilaData.push_back(s);
     }
-    if (!metroManilaData.empty())
-        mergeSort(metroManilaData, 0, metroManilaData.size() - 1);
+    metroPendingChanges++;
+}
 
-    ofstream outfile("metro_manila.txt");
-    if (outfile) {
-        for (auto &s : metroManilaData) {
-            outfile << s.itemName << " " << s.quantity << "\n";
-        }
-        outfile.close();
+// Moves a city's entry for "item" from oldQty to newQty. Pass -1 as oldQty for
+// an item the city did not hold before.
+void updateDonorIndex(ItemId item, const string &city, int oldQty, int newQty) {
+    auto &holders = donorHolders(item);
+    if (oldQty != -1)
+        holders.erase({oldQty, city});
+    holders.insert({newQty, city});
+}
+
+// Returns (city, quantity) for every city other than excludeCity that holds at
+// least minQty of "item", largest quantity first.
+vector<pair<string, int>> findDonors(const string &item, int minQty, const string &excludeCity) {
+    vector<pair<string, int>> donors;
+    ItemId id;
+    if (!findItemId(item, id) || id >= donorIndex.size())
+        return donors;
+    auto &holders = donorIndex[id];
+    for (auto h = holders.rbegin(); h != holders.rend() && h->first >= minQty; ++h) {
+        if (h->second != excludeCity)
+            donors.push_back({h->second, h->first});
+    }
+    return donors;
+}
+
+// Returns the k cities holding the most of "item", largest quantity first.
+vector<pair<string, int>> topDonors(const string &item, int k) {
+    vector<pair<string, int>> donors;
+    ItemId id;
+    if (!findItemId(item, id) || id >= donorIndex.size())
+        return donors;
+    auto &holders = donorIndex[id];
+    for (auto h = holders.rbegin(); h != holders.rend() && (int)donors.size() < k; ++h) {
+        donors.push_back({h->second, h->first});
     }
+    return donors;
+}
+
+// Keeps a city's summary and dirty flag in step with a quantity change.
+void noteCityChanged(const string &city, int oldQty, int newQty) {
+    CityInfo &info = cityRegistry.find(city)->second;
+    info.dirty = true;
+    if (oldQty == -1)
+        info.itemCount++;
+    info.totalUnits += newQty - (oldQty == -1 ? 0 : oldQty);
 }
 
 // -----------------------------------------------------------------------------
-// Log a successful allocation transaction to "historical_transactions.txt".
+// Low-stock watchlist. Each item can have a reorder threshold (from
+// "reorder_thresholds.txt": "item threshold" lines, with "*" for the default of
+// every item not listed). Every city holding less than its item's threshold
+// has an entry in a set ordered by shortfall (threshold - quantity), largest
+// first, so the worst shortages metro-wide are the first entries of the set.
+// The set is built once from the donor index after loading and then patched
+// by onSupplyChanged as quantities change; it never rescans the cities.
+// In service mode changes to different items arrive on different threads, so
+// the set has its own lock. Thresholds only change from the menu.
 // -----------------------------------------------------------------------------
-void logTransaction(const string &donor, const string &recipient, const string &item, int quantity) {
-    time_t now = time(0);
-    char* dt = ctime(&now);
-    string datetime(dt);
-    if (!datetime.empty() && datetime.back() == '\n')
-        datetime.pop_back();
+const char REORDER_THRESHOLDS_FILE[] = "reorder_thresholds.txt";
+const int THRESHOLD_DEFAULT = -1;  // In "perItem": the item uses "defaultThreshold".
 
-    ofstream outfile("historical_transactions.txt", ios::app);
-    if (outfile) {
-        outfile << datetime << " - Allocated " << quantity << " of \""
-                << item << "\" from " << donor << " to " << recipient << "\n";
+struct Shortage {
+    int shortfall;
+    string city;
+    ItemId item;
+    bool operator<(const Shortage &other) const {
+        if (shortfall != other.shortfall)
+            return shortfall > other.shortfall;
+        if (city != other.city)
+            return city < other.city;
+        return item < other.item;
     }
+};
+
+struct Watchlist {
+    vector<int> perItem;       // Item id -> threshold, or THRESHOLD_DEFAULT.
+    int defaultThreshold = 0;  // 0: no alerts for items without their own.
+    set<Shortage> shortages;
+    mutex lock;
+};
+Watchlist watchlist;
+
+int reorderThreshold(ItemId item) {
+    if (item < watchlist.perItem.size() && watchlist.perItem[item] != THRESHOLD_DEFAULT)
+        return watchlist.perItem[item];
+    return watchlist.defaultThreshold;
 }
 
-// -----------------------------------------------------------------------------
-// View historical transactions by reading "historical_transactions.txt".
-// -----------------------------------------------------------------------------
-void viewTransactions() {
-    ifstream infile("historical_transactions.txt");
-    if (!infile) {
-        cout << "\nNo historical transactions found.\n";
+// Adds an entry for every city holding less than "threshold" of "item"
+// (sign 1), or removes them (sign -1). The caller holds watchlist.lock.
+void markShortages(ItemId item, int threshold, int sign) {
+    if (item >= donorIndex.size())
         return;
+    auto &holders = donorIndex[item];
+    for (auto h = holders.begin(); h != holders.end() && h->first < threshold; ++h) {
+        Shortage entry = {threshold - h->first, h->second, item};
+        if (sign > 0)
+            watchlist.shortages.insert(entry);
+        else
+            watchlist.shortages.erase(entry);
     }
-    cout << "\nHistorical Transactions:\n";
-    string line;
-    while(getline(infile, line)) {
-        cout << line << "\n";
+}
+
+void rebuildWatchlist() {
+    lock_guard<mutex> guard(watchlist.lock);
+    watchlist.shortages.clear();
+    for (ItemId item = 0; item < donorIndex.size(); item++)
+        markShortages(item, reorderThreshold(item), 1);
+}
+
+// Moves a city's entry for "item" from oldQty to newQty (oldQty -1: the city
+// did not hold it).
+void updateWatchlist(const string &city, ItemId item, int oldQty, int newQty) {
+    int threshold = reorderThreshold(item);
+    bool wasShort = oldQty != -1 && oldQty < threshold;
+    bool isShort = newQty < threshold;
+    if (!wasShort && !isShort)
+        return;
+    lock_guard<mutex> guard(watchlist.lock);
+    if (wasShort)
+        watchlist.shortages.erase({threshold - oldQty, city, item});
+    if (isShort)
+        watchlist.shortages.insert({threshold - newQty, city, item});
+}
+
+// The "k" largest shortages, largest first.
+vector<Shortage> worstShortages(size_t k) {
+    lock_guard<mutex> guard(watchlist.lock);
+    vector<Shortage> worst;
+    for (auto s = watchlist.shortages.begin(); s != watchlist.shortages.end() && worst.size() < k; ++s)
+        worst.push_back(*s);
+    return worst;
+}
+
+// Changes one item's threshold (THRESHOLD_DEFAULT: back to the default), and
+// only that item's entries.
+void setReorderThreshold(ItemId item, int threshold) {
+    lock_guard<mutex> guard(watchlist.lock);
+    markShortages(item, reorderThreshold(item), -1);
+    if (item >= watchlist.perItem.size())
+        watchlist.perItem.resize(item + 1, THRESHOLD_DEFAULT);
+    watchlist.perItem[item] = threshold;
+    markShortages(item, reorderThreshold(item), 1);
+}
+
+// Reads the threshold file and rebuilds the watchlist. Items named in the file
+// are interned, so a threshold applies once any city receives the item.
+void loadReorderThresholds() {
+    watchlist.perItem.clear();
+    watchlist.defaultThreshold = 0;
+    ifstream infile(REORDER_THRESHOLDS_FILE);
+    string item;
+    int threshold;
+    while (infile >> item >> threshold) {
+        if (threshold < 0)
+            continue;
+        if (item == "*") {
+            watchlist.defaultThreshold = threshold;
+            continue;
+        }
+        ItemId id = internItem(item);
+        if (id >= watchlist.perItem.size())
+            watchlist.perItem.resize(id + 1, THRESHOLD_DEFAULT);
+        watchlist.perItem[id] = threshold;
     }
-    infile.close();
+    rebuildWatchlist();
 }
 
 // -----------------------------------------------------------------------------
-// Initialization: Create sample files for each city if they do not exist.
+// Called at every point that changes a city's quantity of an item so the
+// derived structures (donor index, Metro Manila aggregate, low-stock
+// watchlist) stay in step.
+// oldQty is -1 when the city did not hold the item before.
 // -----------------------------------------------------------------------------
-void initializeSampleFiles() {
-    vector<pair<string, vector<pair<string, int>>>> samples = {
-        {"Mandaluyong", {
+void onSupplyChanged(const string &city, ItemId item, int oldQty, int newQty) {
+    noteCityChanged(city, oldQty, newQty);
+    updateDonorIndex(item, city, oldQty, newQty);
+    updateWatchlist(city, item, oldQty, newQty);
+    applyMetroDelta(item, newQty - (oldQty == -1 ? 0 : oldQty));
+}
+
+// -----------------------------------------------------------------------------
+// Transaction journal ("transactions.journal").
+// Records are encoded in a compact binary format into a reusable in-memory
+// buffer while the file stays open. An operation's records are written out
+// (and fsync'ed with "--fsync") as one group commit before it reports
+// success; a large batch also commits whenever the buffer reaches
+// JOURNAL_COMMIT_BYTES. Service threads that journal at the same time share
+// a commit: one of them writes everything buffered while the others wait
+// for it (see commitJournalThrough).
+//
+// File layout: "RJNL", u16 version, u16 reserved, then records of
+//   u32 length of the rest | i64 time | i32 quantity |
+//   u16 donor length | u16 recipient length | u16 item length | names...
+// followed, in a shard's records of a transfer between shards, by
+//   u16 transfer id length | transfer id.
+// All integers are little-endian. "historical_transactions.txt" is now a
+// text export of the journal for humans.
+// -----------------------------------------------------------------------------
+const char JOURNAL_FILE[] = "transactions.journal";
+const char JOURNAL_MAGIC[] = "RJNL";
+const int JOURNAL_VERSION = 1;
+const size_t JOURNAL_HEADER_SIZE = 8;
+const size_t JOURNAL_COMMIT_BYTES = 64 * 1024;
+
+enum JournalDurability {
+    JOURNAL_BUFFERED,  // Group commits are handed to the OS (survives a program crash).
+    JOURNAL_FSYNC      // Group commits are also fsync'ed (survives a power loss).
+};
+
+struct Journal {
+    int fd = -1;
+    string buffer;              // Encoded records waiting for the next group commit.
+    string writing;             // The group being written; only its writer touches it.
+    bool committing = false;    // A thread is writing "writing".
+    JournalDurability durability = JOURNAL_BUFFERED;
+    unsigned long long size = 0;  // Bytes already written to the file.
+    mutex lock;                   // Guards the rest while the service runs.
+    condition_variable committed;  // Signalled when a group commit finishes.
+};
+Journal journal;
+
+void putLE(string &buf, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        buf.push_back(char((value >> (8 * i)) & 0xFF));
+}
+
+unsigned long long getLE(const char *p, int bytes) {
+    unsigned long long value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (unsigned long long)(unsigned char)p[i] << (8 * i);
+    return value;
+}
+
+void encodeTransaction(string &buf, const Transaction &t) {
+    size_t trailer = t.transfer.empty() ? 0 : 2 + t.transfer.size();
+    putLE(buf, 8 + 4 + 6 + t.donor.size() + t.recipient.size() + t.item.size() + trailer, 4);
+    putLE(buf, (unsigned long long)t.time, 8);
+    putLE(buf, (unsigned int)t.quantity, 4);
+    putLE(buf, t.donor.size(), 2);
+    putLE(buf, t.recipient.size(), 2);
+    putLE(buf, t.item.size(), 2);
+    buf += t.donor;
+    buf += t.recipient;
+    buf += t.item;
+    if (trailer) {
+        putLE(buf, t.transfer.size(), 2);
+        buf += t.transfer;
+    }
+}
+
+// Decodes one record from p[0..available). Returns the number of bytes used,
+// or 0 if the data is truncated or corrupt.
+size_t decodeTransaction(const char *p, size_t available, Transaction &t) {
+    if (available < 4)
+        return 0;
+    size_t length = getLE(p, 4);
+    if (length < 18 || available - 4 < length)
+        return 0;
+    t.time = (long long)getLE(p + 4, 8);
+    t.quantity = (int)getLE(p + 12, 4);
+    size_t donorLen = getLE(p + 16, 2), recipientLen = getLE(p + 18, 2), itemLen = getLE(p + 20, 2);
+    size_t namesEnd = 18 + donorLen + recipientLen + itemLen;
+    if (namesEnd != length && (namesEnd + 2 > length || namesEnd + 2 + getLE(p + 4 + namesEnd, 2) != length))
+        return 0;
+    const char *names = p + 22;
+    t.donor.assign(names, donorLen);
+    t.recipient.assign(names + donorLen, recipientLen);
+    t.item.assign(names + donorLen + recipientLen, itemLen);
+    if (namesEnd == length)
+        t.transfer.clear();
+    else
+        t.transfer.assign(p + 4 + namesEnd + 2, length - namesEnd - 2);
+    return 4 + length;
+}
+
+// Formats a record the way the text log always has.
+string formatTime(long long seconds) {
+    time_t when = (time_t)seconds;
+    string datetime(ctime(&when));
+    if (!datetime.empty() && datetime.back() == '\n')
+        datetime.pop_back();
+    return datetime;
+}
+
+string formatTransaction(const Transaction &t) {
+    if (t.quantity < 0) {
+        return formatTime(t.time) + " - Cancelled allocation of " + to_string(-t.quantity) + " of \"" + t.item +
+               "\" from " + t.donor + " to " + t.recipient;
+    }
+    return formatTime(t.time) + " - Allocated " + to_string(t.quantity) + " of \"" + t.item +
+           "\" from " + t.donor + " to " + t.recipient;
+}
+
+// Parses a line of the old text log back into a record. Returns false if the
+// line does not have the expected shape.
+bool parseTransactionLine(const string &line, Transaction &t) {
+    size_t sep = line.find(" - Allocated ");
+    if (sep == string::npos)
+        return false;
+    tm when = {};
+    istringstream dateStream(line.substr(0, sep));
+    dateStream >> get_time(&when, "%a %b %d %H:%M:%S %Y");
+    if (dateStream.fail())
+        return false;
+    when.tm_isdst = -1;
+    t.time = (long long)mktime(&when);
+    istringstream rest(line.substr(sep + 13));
+    string of, from, to;
+    if (!(rest >> t.quantity >> of) || of != "of")
+        return false;
+    rest >> ws;
+    if (rest.get() != '"' || !getline(rest, t.item, '"'))
+        return false;
+    return bool(rest >> from >> t.donor >> to >> t.recipient) && from == "from" && to == "to";
+}
+
+// -----------------------------------------------------------------------------
+// Sparse journal index ("transactions.idx").
+// The journal is split into buckets of consecutive records: a new bucket
+// starts at every JOURNAL_BUCKET_SECONDS boundary or after
+// JOURNAL_BUCKET_RECORDS records. Each bucket stores its file offset, record
+// count and time range, and every city (as donor or recipient) and item has a
+// posting list of the buckets it appears in. A query only reads the buckets
+// that can contain matches. The index is kept up to date as records are
+// appended, saved on exit, and on startup any journal records written after
+// the saved index are scanned to catch up.
+//
+// File layout: "RJIX", u16 version, u16 reserved, u64 indexed bytes,
+//   u32 bucket count, buckets (i64 min time, i64 max time, u64 offset, u32 count),
+//   u32 key count, keys (u8 kind: 0 city / 1 item, u16 length, name,
+//   u32 posting count, u32 bucket ids...).
+// -----------------------------------------------------------------------------
+const char JOURNAL_INDEX_FILE[] = "transactions.idx";
+const char JOURNAL_INDEX_MAGIC[] = "RJIX";
+const int JOURNAL_INDEX_VERSION = 1;
+const int JOURNAL_BUCKET_SECONDS = 3600;
+const unsigned int JOURNAL_BUCKET_RECORDS = 1024;
+
+struct JournalBucket {
+    long long minTime;
+    long long maxTime;
+    unsigned long long offset;  // File offset of the bucket's first record.
+    unsigned int count;         // Records in the bucket.
+};
+
+struct JournalIndex {
+    vector<JournalBucket> buckets;
+    map<string, vector<unsigned int>> cityPostings;  // City (donor or recipient) -> bucket ids.
+    map<string, vector<unsigned int>> itemPostings;  // Item -> bucket ids.
+    unsigned long long indexedBytes = 0;              // End of the last indexed record.
+};
+JournalIndex journalIndex;
+
+void addPosting(vector<unsigned int> &postings, unsigned int bucket) {
+    if (postings.empty() || postings.back() != bucket)
+        postings.push_back(bucket);
+}
+
+// Adds the record of "size" bytes at journal offset "offset" to the index.
+void indexTransaction(const Transaction &t, unsigned long long offset, size_t size) {
+    vector<JournalBucket> &buckets = journalIndex.buckets;
+    if (buckets.empty() || buckets.back().count >= JOURNAL_BUCKET_RECORDS ||
+        t.time / JOURNAL_BUCKET_SECONDS != buckets.back().maxTime / JOURNAL_BUCKET_SECONDS) {
+        buckets.push_back({t.time, t.time, offset, 0});
+    }
+    JournalBucket &bucket = buckets.back();
+    bucket.minTime = min(bucket.minTime, t.time);
+    bucket.maxTime = max(bucket.maxTime, t.time);
+    bucket.count++;
+    unsigned int id = buckets.size() - 1;
+    addPosting(journalIndex.cityPostings[t.donor], id);
+    addPosting(journalIndex.cityPostings[t.recipient], id);
+    addPosting(journalIndex.itemPostings[t.item], id);
+    journalIndex.indexedBytes = offset + size;
+}
+
+// Reads journal bytes [offset, offset + length) and calls visit() with each
+// complete record, its offset and its size. Returns the offset just past the
+// last complete record.
+unsigned long long readJournalRegion(unsigned long long offset, unsigned long long length,
+                                     const function<void(const Transaction &, unsigned long long, size_t)> &visit) {
+    ifstream infile(JOURNAL_FILE, ios::binary);
+    if (!infile || length == 0)
+        return offset;
+    string data(length, '\0');
+    infile.seekg(offset);
+    infile.read(&data[0], length);
+    data.resize(infile.gcount());
+    size_t pos = 0;
+    Transaction t;
+    while (size_t used = decodeTransaction(data.data() + pos, data.size() - pos, t)) {
+        visit(t, offset + pos, used);
+        pos += used;
+    }
+    return offset + pos;
+}
+
+void saveJournalIndex() {
+    string buf;
+    buf.append(JOURNAL_INDEX_MAGIC, 4);
+    putLE(buf, JOURNAL_INDEX_VERSION, 2);
+    putLE(buf, 0, 2);
+    putLE(buf, journalIndex.indexedBytes, 8);
+    putLE(buf, journalIndex.buckets.size(), 4);
+    for (auto &b : journalIndex.buckets) {
+        putLE(buf, (unsigned long long)b.minTime, 8);
+        putLE(buf, (unsigned long long)b.maxTime, 8);
+        putLE(buf, b.offset, 8);
+        putLE(buf, b.count, 4);
+    }
+    putLE(buf, journalIndex.cityPostings.size() + journalIndex.itemPostings.size(), 4);
+    for (int kind = 0; kind < 2; kind++) {
+        for (auto &entry : (kind == 0 ? journalIndex.cityPostings : journalIndex.itemPostings)) {
+            putLE(buf, kind, 1);
+            putLE(buf, entry.first.size(), 2);
+            buf += entry.first;
+            putLE(buf, entry.second.size(), 4);
+            for (unsigned int id : entry.second)
+                putLE(buf, id, 4);
+        }
+    }
+    string tempFile = string(JOURNAL_INDEX_FILE) + ".tmp";
+    ofstream outfile(tempFile, ios::binary);
+    if (!outfile)
+        return;
+    outfile.write(buf.data(), buf.size());
+    outfile.close();
+    if (outfile)
+        rename(tempFile.c_str(), JOURNAL_INDEX_FILE);
+}
+
+// Loads the saved index. Returns false (leaving the index empty) if it is
+// missing, corrupt or describes more bytes than the journal has.
+bool loadJournalIndex(unsigned long long journalSize) {
+    ifstream infile(JOURNAL_INDEX_FILE, ios::binary);
+    if (!infile)
+        return false;
+    string data((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+    const char *p = data.data(), *end = p + data.size();
+    auto need = [&](size_t n) { return (size_t)(end - p) >= n; };
+    if (!need(20) || data.compare(0, 4, JOURNAL_INDEX_MAGIC) != 0 ||
+        (int)getLE(p + 4, 2) != JOURNAL_INDEX_VERSION)
+        return false;
+    JournalIndex loaded;
+    loaded.indexedBytes = getLE(p + 8, 8);
+    size_t bucketCount = getLE(p + 16, 4);
+    p += 20;
+    if (loaded.indexedBytes > journalSize || !need(bucketCount * 28))
+        return false;
+    for (size_t i = 0; i < bucketCount; i++, p += 28) {
+        loaded.buckets.push_back({(long long)getLE(p, 8), (long long)getLE(p + 8, 8),
+                                  getLE(p + 16, 8), (unsigned int)getLE(p + 24, 4)});
+    }
+    if (!need(4))
+        return false;
+    size_t keyCount = getLE(p, 4);
+    p += 4;
+    for (size_t i = 0; i < keyCount; i++) {
+        if (!need(3))
+            return false;
+        int kind = (int)getLE(p, 1);
+        size_t nameLen = getLE(p + 1, 2);
+        p += 3;
+        if (!need(nameLen + 4))
+            return false;
+        string name(p, nameLen);
+        size_t count = getLE(p + nameLen, 4);
+        p += nameLen + 4;
+        if (!need(count * 4))
+            return false;
+        vector<unsigned int> &postings = (kind == 0 ? loaded.cityPostings : loaded.itemPostings)[name];
+        for (size_t j = 0; j < count; j++, p += 4)
+            postings.push_back((unsigned int)getLE(p, 4));
+    }
+    journalIndex = loaded;
+    return true;
+}
+
+// Writes one group to the file. Returns false (and stops logging) if the
+// write fails.
+bool writeJournalGroup(const string &group) {
+    STATS_TIME(STAT_JOURNAL_COMMIT);
+    STATS_COUNT(STAT_JOURNAL_BYTES, group.size());
+    const char *data = group.data();
+    size_t remaining = group.size();
+    while (remaining > 0) {
+        long written = write(journal.fd, data, remaining);
+        if (written <= 0) {
+            cout << "Error: could not write to \"" << JOURNAL_FILE << "\"; transactions will not be logged.\n";
+            return false;
+        }
+        data += written;
+        remaining -= written;
+    }
+    if (journal.durability == JOURNAL_FSYNC)
+        fsync(journal.fd);
+    return true;
+}
+
+// Returns once the file holds the first "end" bytes of the journal. If
+// another thread is already writing a group, waits for it; otherwise writes
+// everything buffered so far as one group, so records buffered while a
+// commit is in flight go out together in the next one.
+void commitJournalThrough(unique_lock<mutex> &guard, unsigned long long end) {
+    while (journal.size < end && journal.fd != -1) {
+        if (journal.committing) {
+            journal.committed.wait(guard);
+            continue;
+        }
+        journal.committing = true;
+        journal.writing.swap(journal.buffer);
+        guard.unlock();
+        bool ok = writeJournalGroup(journal.writing);
+        guard.lock();
+        if (ok) {
+            journal.size += journal.writing.size();
+        } else {
+            close(journal.fd);
+            journal.fd = -1;
+        }
+        journal.writing.clear();  // Keeps its capacity for a later group.
+        journal.committing = false;
+        journal.committed.notify_all();
+    }
+    if (journal.fd == -1)
+        journal.buffer.clear();  // Nowhere to write it.
+}
+
+// Writes everything in the buffer to the journal file as one group commit.
+void commitJournal() {
+    unique_lock<mutex> guard(journal.lock);
+    commitJournalThrough(guard, journal.size + journal.writing.size() + journal.buffer.size());
+}
+
+// Encodes a record into the commit buffer and indexes it. The caller holds
+// journal.lock (or is alone). Returns the journal's size once the record is
+// written.
+unsigned long long bufferJournalRecord(const Transaction &t) {
+    unsigned long long offset = journal.size + journal.writing.size() + journal.buffer.size();
+    encodeTransaction(journal.buffer, t);
+    STATS_COUNT(STAT_JOURNAL_RECORDS, 1);
+    unsigned long long end = journal.size + journal.writing.size() + journal.buffer.size();
+    indexTransaction(t, offset, end - offset);
+    return end;
+}
+
+// Opens (creating if needed) the journal for appending and brings its index up
+// to date. A new journal is seeded from an existing
+// "historical_transactions.txt" so no history is lost. A record left half
+// written by a crash is cut off so later appends stay readable.
+void openJournal(JournalDurability durability) {
+    journal.durability = durability;
+    journal.buffer.reserve(JOURNAL_COMMIT_BYTES + 1024);
+    journal.fd = open(JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0644);
+    if (journal.fd == -1) {
+        cout << "Error: could not open \"" << JOURNAL_FILE << "\".\n";
+        return;
+    }
+    journal.size = lseek(journal.fd, 0, SEEK_END);
+    char header[4] = {};
+    ifstream(JOURNAL_FILE, ios::binary).read(header, 4);
+    if (journal.size > 0 && (journal.size < JOURNAL_HEADER_SIZE || memcmp(header, JOURNAL_MAGIC, 4) != 0)) {
+        cout << "Error: \"" << JOURNAL_FILE << "\" is not a transaction journal; transactions will not be logged.\n";
+        close(journal.fd);
+        journal.fd = -1;
+        return;
+    }
+    if (journal.size == 0) {
+        journal.buffer.append(JOURNAL_MAGIC, 4);
+        putLE(journal.buffer, JOURNAL_VERSION, 2);
+        putLE(journal.buffer, 0, 2);
+        journalIndex = JournalIndex();
+        journalIndex.indexedBytes = JOURNAL_HEADER_SIZE;
+        ifstream legacy("historical_transactions.txt");
+        string line;
+        Transaction t;
+        while (getline(legacy, line)) {
+            if (parseTransactionLine(line, t))
+                bufferJournalRecord(t);
+        }
+        commitJournal();
+    } else {
+        if (!loadJournalIndex(journal.size)) {
+            journalIndex = JournalIndex();
+            journalIndex.indexedBytes = JOURNAL_HEADER_SIZE;
+        }
+        unsigned long long validEnd = readJournalRegion(
+            journalIndex.indexedBytes, journal.size - journalIndex.indexedBytes,
+            [](const Transaction &t, unsigned long long offset, size_t size) {
+                indexTransaction(t, offset, size);
+            });
+        if (validEnd < journal.size && ftruncate(journal.fd, validEnd) == 0)
+            journal.size = validEnd;
+    }
+}
+
+void closeJournal() {
+    commitJournal();
+    saveJournalIndex();
+    if (journal.fd != -1)
+        close(journal.fd);
+    journal.fd = -1;
+}
+
+// Reads the whole journal and calls visit() for each record, oldest first.
+// Returns false if the journal does not exist or is not a journal file.
+bool readJournal(const function<void(const Transaction &)> &visit) {
+    commitJournal();
+    ifstream infile(JOURNAL_FILE, ios::binary);
+    if (!infile)
+        return false;
+    string data((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+    if (data.size() < JOURNAL_HEADER_SIZE || data.compare(0, 4, JOURNAL_MAGIC) != 0)
+        return false;
+    size_t pos = JOURNAL_HEADER_SIZE;
+    Transaction t;
+    while (size_t used = decodeTransaction(data.data() + pos, data.size() - pos, t)) {
+        visit(t);
+        pos += used;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Filtered history queries. Candidate buckets come from intersecting the
+// posting lists of the requested cities/item and checking each bucket's time
+// range; only those regions of the journal are read.
+// -----------------------------------------------------------------------------
+struct HistoryQuery {
+    string donor;                   // Empty fields match anything.
+    string recipient;
+    string city;                    // Matches either the donor or the recipient.
+    string item;
+    long long fromTime = LLONG_MIN;
+    long long toTime = LLONG_MAX;
+    int last = 0;                   // If positive, only the most recent "last" matches.
+};
+
+bool matchesQuery(const Transaction &t, const HistoryQuery &q) {
+    return (q.donor.empty() || t.donor == q.donor) &&
+           (q.recipient.empty() || t.recipient == q.recipient) &&
+           (q.city.empty() || t.donor == q.city || t.recipient == q.city) &&
+           (q.item.empty() || t.item == q.item) &&
+           t.time >= q.fromTime && t.time <= q.toTime;
+}
+
+vector<unsigned int> candidateBuckets(const HistoryQuery &q) {
+    vector<unsigned int> result;
+    bool restricted = false;
+    auto restrictTo = [&](const map<string, vector<unsigned int>> &postings, const string &key) {
+        if (key.empty())
+            return;
+        auto it = postings.find(key);
+        vector<unsigned int> list = (it != postings.end()) ? it->second : vector<unsigned int>();
+        if (restricted) {
+            vector<unsigned int> both;
+            set_intersection(result.begin(), result.end(), list.begin(), list.end(), back_inserter(both));
+            list.swap(both);
+        }
+        result.swap(list);
+        restricted = true;
+    };
+    restrictTo(journalIndex.cityPostings, q.donor);
+    restrictTo(journalIndex.cityPostings, q.recipient);
+    restrictTo(journalIndex.cityPostings, q.city);
+    restrictTo(journalIndex.itemPostings, q.item);
+    if (!restricted) {
+        for (unsigned int id = 0; id < journalIndex.buckets.size(); id++)
+            result.push_back(id);
+    }
+    vector<unsigned int> inRange;
+    for (unsigned int id : result) {
+        const JournalBucket &b = journalIndex.buckets[id];
+        if (b.maxTime >= q.fromTime && b.minTime <= q.toTime)
+            inRange.push_back(id);
+    }
+    return inRange;
+}
+
+// Returns the matching records, oldest first.
+vector<Transaction> queryHistory(const HistoryQuery &q) {
+    commitJournal();
+    vector<unsigned int> candidates = candidateBuckets(q);
+    auto readBucket = [&](unsigned int id, vector<Transaction> &out) {
+        const vector<JournalBucket> &buckets = journalIndex.buckets;
+        unsigned long long begin = buckets[id].offset;
+        unsigned long long end = (id + 1 < buckets.size()) ? buckets[id + 1].offset : journalIndex.indexedBytes;
+        readJournalRegion(begin, end - begin, [&](const Transaction &t, unsigned long long, size_t) {
+            if (matchesQuery(t, q))
+                out.push_back(t);
+        });
+    };
+    vector<Transaction> matches;
+    if (q.last <= 0) {
+        for (unsigned int id : candidates)
+            readBucket(id, matches);
+        return matches;
+    }
+    // Tail query: read buckets newest first until enough matches are found.
+    vector<vector<Transaction>> chunks;
+    size_t found = 0;
+    for (auto it = candidates.rbegin(); it != candidates.rend() && found < (size_t)q.last; ++it) {
+        chunks.emplace_back();
+        readBucket(*it, chunks.back());
+        found += chunks.back().size();
+    }
+    for (auto it = chunks.rbegin(); it != chunks.rend(); ++it)
+        matches.insert(matches.end(), it->begin(), it->end());
+    if (matches.size() > (size_t)q.last)
+        matches.erase(matches.begin(), matches.end() - q.last);
+    return matches;
+}
+
+// -----------------------------------------------------------------------------
+// Export the journal as text to "historical_transactions.txt".
+// -----------------------------------------------------------------------------
+void exportTransactions() {
+    ofstream outfile("historical_transactions.txt");
+    int count = 0;
+    bool found = readJournal([&](const Transaction &t) {
+        outfile << formatTransaction(t) << "\n";
+        count++;
+    });
+    if (!found) {
+        cout << "\nNo historical transactions found.\n";
+        return;
+    }
+    cout << "\nExported " << count << " transactions to \"historical_transactions.txt\".\n";
+}
+
+// -----------------------------------------------------------------------------
+// View historical transactions by reading the journal.
+// -----------------------------------------------------------------------------
+void viewTransactions() {
+    cout << "\nHistorical Transactions:\n";
+    int count = 0;
+    readJournal([&](const Transaction &t) {
+        cout << formatTransaction(t) << "\n";
+        count++;
+    });
+    if (count == 0)
+        cout << "No historical transactions found.\n";
+}
+
+// -----------------------------------------------------------------------------
+// Option: Query historical transactions with filters.
+// -----------------------------------------------------------------------------
+void queryTransactions() {
+    HistoryQuery q;
+    string input;
+    cout << "\nLeave a filter blank to match anything.\n";
+    cout << "Donor city: ";
+    getline(cin, q.donor);
+    cout << "Recipient city: ";
+    getline(cin, q.recipient);
+    cout << "City involved (donor or recipient): ";
+    getline(cin, q.city);
+    cout << "Item: ";
+    getline(cin, q.item);
+    cout << "Only the last N hours: ";
+    getline(cin, input);
+    if (!input.empty())
+        q.fromTime = (long long)time(0) - atoll(input.c_str()) * 3600;
+    cout << "Show only the most recent N entries: ";
+    getline(cin, input);
+    if (!input.empty())
+        q.last = atoi(input.c_str());
+
+    vector<Transaction> matches = queryHistory(q);
+    cout << "\nMatching transactions:\n";
+    for (auto &t : matches) {
+        cout << formatTransaction(t) << "\n";
+    }
+    cout << matches.size() << " transaction(s) found.\n";
+}
+
+// The names listed in a registered_cities.txt file ("path").
+vector<string> readCityList(const string &path) {
+    vector<string> cities;
+    ifstream infile(path);
+    string line;
+    while (getline(infile, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            cities.push_back(line);
+    }
+    return cities;
+}
+
+// -----------------------------------------------------------------------------
+// The list of cities to register: the names in "registered_cities.txt", or
+// the sample cities if that file does not exist yet.
+// -----------------------------------------------------------------------------
+vector<string> discoverCities() {
+    vector<string> cities = readCityList("registered_cities.txt");
+    if (cities.empty())
+        cities = {"Mandaluyong", "Caloocan", "Manila", "Paranaque", "Pasay", "QuezonCity", "Pasig"};
+    return cities;
+}
+
+// -----------------------------------------------------------------------------
+// Initialization: Create sample files for each city if they do not exist.
+// Only the cities that will be registered get one (a shard registers some).
+// -----------------------------------------------------------------------------
+void initializeSampleFiles() {
+    vector<pair<string, vector<pair<string, int>>>> samples = {
+        {"Mandaluyong", {
             {"canned_goods",150}, {"water_bottles",200}, {"rice",250},
             {"noodles",180}, {"medicine",120}, {"blankets",130},
             {"clothes",170}, {"diapers",140}, {"fuel",110}, {"first_aid",160},
@@ -297,167 +1904,3420 @@ void initializeSampleFiles() {
         }}
     };
 
-    for (auto &city : samples) {
-        // Use the city name as the filename (adjust naming if needed)
-        string filename = city.first + ".txt";
-        ifstream infile(filename);
-        if (!infile) { // File does not exist – create it.
-            ofstream outfile(filename);
-            if (outfile) {
-                for (auto &supply : city.second) {
-                    outfile << supply.first << " " << supply.second << "\n";
-                }
-                outfile.close();
-                cout << "Created sample file: " << filename << "\n";
-            }
-        }
+    vector<string> cities = discoverCities();
+    for (auto &city : samples) {
+        if (find(cities.begin(), cities.end(), city.first) == cities.end())
+            continue;
+        // Use the city name as the filename (adjust naming if needed)
+        string filename = city.first + ".txt";
+        ifstream infile(filename);
+        if (!infile) { // File does not exist – create it.
+            ofstream outfile(filename);
+            if (outfile) {
+                for (auto &supply : city.second) {
+                    outfile << supply.first << " " << supply.second << "\n";
+                }
+                outfile.close();
+                cout << "Created sample file: " << filename << "\n";
+            }
+        }
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// Read-only view of a whole file. Memory-mapped on POSIX systems; elsewhere
+// the file is read into a buffer owned by the view.
+// -----------------------------------------------------------------------------
+struct MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    string buffer;  // Holds the contents when the file is not memory-mapped.
+};
+
+bool mapFile(const string &filename, MappedFile &file) {
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+    file.size = info.st_size;
+    if (file.size > 0) {
+        void *addr = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            file.data = static_cast<const char *>(addr);
+            file.mapped = true;
+        }
+    }
+    close(fd);
+    if (file.mapped || file.size == 0)
+        return true;
+#endif
+    ifstream infile(filename, ios::binary);
+    if (!infile)
+        return false;
+    file.buffer.assign(istreambuf_iterator<char>(infile), istreambuf_iterator<char>());
+    file.data = file.buffer.data();
+    file.size = file.buffer.size();
+    return true;
+}
+
+void unmapFile(MappedFile &file) {
+#ifndef _WIN32
+    if (file.mapped)
+        munmap(const_cast<char *>(file.data), file.size);
+#endif
+    file = MappedFile();
+}
+
+// -----------------------------------------------------------------------------
+// Reads and sorts a city's dataset from its file without touching any global
+// state, so several cities can be parsed at once. Returns false if the file
+// does not exist.
+// The file is memory-mapped and each "item qty" line is tokenized in place;
+// quantities are parsed with from_chars. Item names are interned through a
+// per-file cache, so the shared dictionary is only locked for names the file
+// has not used yet. Malformed lines are skipped and described in "errors" with
+// their line numbers. Duplicate items are summed.
+// -----------------------------------------------------------------------------
+bool parseCityDataset(const string &city, vector<Supply> &supplies, vector<string> &errors) {
+    STATS_TIME(STAT_LOAD);
+    string filename = city + ".txt";
+    MappedFile file;
+    if (!mapFile(filename, file))
+        return false;
+
+    supplies.clear();
+    errors.clear();
+    unordered_map<string_view, ItemId> seen;  // Keys point into the mapped file.
+    const char *p = file.data, *end = file.data + file.size;
+    int lineNo = 0;
+    auto isSpace = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+    while (p < end) {
+        lineNo++;
+        const char *lineEnd = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!lineEnd)
+            lineEnd = end;
+        const char *q = p;
+        p = lineEnd + 1;
+
+        while (q < lineEnd && isSpace(*q)) q++;
+        if (q == lineEnd)
+            continue;  // Blank line.
+        const char *itemBegin = q;
+        while (q < lineEnd && !isSpace(*q)) q++;
+        const char *itemEnd = q;
+        while (q < lineEnd && isSpace(*q)) q++;
+        const char *qtyBegin = q;
+        while (q < lineEnd && !isSpace(*q)) q++;
+        const char *qtyEnd = q;
+        while (q < lineEnd && isSpace(*q)) q++;
+
+        // Built only for a bad line, so valid lines allocate nothing.
+        auto where = [&]() { return filename + " line " + to_string(lineNo) + ": "; };
+        if (qtyBegin == qtyEnd) {
+            errors.push_back(where() + "missing quantity");
+            continue;
+        }
+        if (q != lineEnd) {
+            errors.push_back(where() + "unexpected text \"" + string(q, lineEnd - q) + "\"");
+            continue;
+        }
+        int qty;
+        from_chars_result parsed = from_chars(qtyBegin, qtyEnd, qty);
+        if (parsed.ec != errc() || parsed.ptr != qtyEnd || qty < 0) {
+            errors.push_back(where() + "invalid quantity \"" + string(qtyBegin, qtyEnd - qtyBegin) + "\"");
+            continue;
+        }
+        string_view name(itemBegin, itemEnd - itemBegin);
+        auto known = seen.find(name);
+        if (known == seen.end())
+            known = seen.emplace(name, internItem(name)).first;
+        Supply s;
+        s.itemId = known->second;
+        s.quantity = qty;
+        supplies.push_back(s);
+    }
+    unmapFile(file);
+
+    // Sort by item, then sum runs of the same item into a single record.
+    if (!supplies.empty())
+        quickSort(supplies, 0, supplies.size() - 1);
+    size_t out = 0;
+    for (size_t i = 0; i < supplies.size(); i++) {
+        if (out > 0 && supplies[out - 1].itemId == supplies[i].itemId)
+            supplies[out - 1].quantity += supplies[i].quantity;
+        else
+            supplies[out++] = supplies[i];
+    }
+    supplies.resize(out);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Inventory snapshot ("inventory.snap"): the full in-memory state (every
+// city's dataset and the Metro Manila aggregate) in a versioned binary file,
+// so a restart costs one mmap and a linear scan instead of parsing, summing
+// and sorting every city file. Records are stored in their sorted order, so
+// the city datasets are usable as their own item index straight away.
+// Item names are stored once in a table at the start and records refer to
+// them by their position in it, so every record has the same fixed size.
+// The snapshot is written to a temporary file and renamed over the old one,
+// so a crash never leaves a half-written snapshot behind.
+//
+// File layout: "RSNP", u16 version, u16 reserved, u64 payload size,
+//   u64 FNV-1a checksum of the payload, then the payload:
+//   u32 item count, items (u16 name length, name),
+//   u32 city count, cities (u16 name length, name, u32 record count, records),
+//   u32 metro record count, records. A record is u32 item number, i32 quantity.
+// -----------------------------------------------------------------------------
+const char SNAPSHOT_FILE[] = "inventory.snap";
+const char SNAPSHOT_MAGIC[] = "RSNP";
+const int SNAPSHOT_VERSION = 2;
+const size_t SNAPSHOT_HEADER_SIZE = 24;
+const size_t SNAPSHOT_RECORD_SIZE = 8;
+MappedFile snapshotView;      // The current snapshot, kept mapped for lazy loading.
+vector<ItemId> snapshotItems;  // Item number in snapshotView -> interned item id.
+
+unsigned long long fnv1a(const char *data, size_t size) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Records are written with their interned ids, so the snapshot's item table
+// is the whole dictionary in id order.
+void encodeSupplies(string &buf, const vector<Supply> &supplies) {
+    putLE(buf, supplies.size(), 4);
+    for (auto &s : supplies) {
+        putLE(buf, s.itemId, 4);
+        putLE(buf, (unsigned int)s.quantity, 4);
+    }
+}
+
+// Decodes a record list written by encodeSupplies, advancing p and mapping
+// item numbers through "items". Returns false if it runs past "end" or names
+// an item the table does not have.
+bool decodeSupplies(const char *&p, const char *end, const vector<ItemId> &items, vector<Supply> &supplies) {
+    if (end - p < 4)
+        return false;
+    size_t count = getLE(p, 4);
+    p += 4;
+    if ((size_t)(end - p) / SNAPSHOT_RECORD_SIZE < count)
+        return false;
+    supplies.clear();
+    supplies.reserve(count);
+    for (size_t i = 0; i < count; i++, p += SNAPSHOT_RECORD_SIZE) {
+        size_t number = getLE(p, 4);
+        if (number >= items.size())
+            return false;
+        Supply s;
+        s.itemId = items[number];
+        s.quantity = (int)getLE(p + 4, 4);
+        supplies.push_back(s);
+    }
+    return true;
+}
+
+// Writes a file atomically: the data goes to "<filename>.tmp", is flushed to
+// disk, and then renamed over "filename".
+bool writeFileAtomically(const string &filename, const string &data) {
+    string tempFile = filename + ".tmp";
+    int fd = open(tempFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd == -1)
+        return false;
+    size_t done = 0;
+    while (done < data.size()) {
+        long written = write(fd, data.data() + done, data.size() - done);
+        if (written <= 0)
+            break;
+        done += written;
+    }
+    bool ok = (done == data.size()) && fsync(fd) == 0;
+    close(fd);
+#ifdef _WIN32
+    if (ok)
+        remove(filename.c_str());
+#endif
+    if (!ok || rename(tempFile.c_str(), filename.c_str()) != 0) {
+        remove(tempFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Directory locks. Only one process may use a directory's inventory at a
+// time, so before loading anything the program takes an exclusive flock on
+// "inventory.lock" in its directory (a shard: in its shard directory), and a
+// coordinator takes one on "coordinator.lock" before it touches the shard
+// layout. A lock is held until the process exits; the kernel then drops it,
+// even after a crash, so a stale lock file never blocks a start.
+// -----------------------------------------------------------------------------
+const char INVENTORY_LOCK_FILE[] = "inventory.lock";
+const char COORDINATOR_LOCK_FILE[] = "coordinator.lock";
+
+// Takes the lock on "filename", keeping its descriptor open for the rest of
+// the run. Returns false if another process holds it.
+bool lockForProcess(const char *filename) {
+#ifdef _WIN32
+    (void)filename;  // No flock; one process per directory is up to the operator.
+    return true;
+#else
+    int fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return false;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return false;
+    }
+    return true;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Inventory delta log ("inventory.deltas"). Every change to a city's quantity
+// of an item is appended as a record of the city, the item and the new
+// quantity, so allocations survive a crash without rewriting whole files: an
+// allocation writes two small records, one for each city it touches. Records
+// hold absolute quantities, so replaying one twice is harmless. A change's
+// records are held back until the journal record of its transaction has been
+// committed, and are then written to the file in one go (and fsync'ed with
+// "--fsync"), so a change recovered from the log is always in the journal.
+// Each record has a checksum; a record left half written by a crash is cut
+// off.
+// The log is emptied whenever the full snapshot is saved. In between, once it
+// grows past DELTA_COMPACT_BYTES it is compacted (see compactDeltasIfDue).
+// At startup any records left over are replayed on top of the loaded
+// inventory.
+//
+// File layout: "RDLT", u16 version, u16 reserved, then records:
+//   u32 checksum (low 32 bits of the FNV-1a of the rest of the record),
+//   u16 city length, u16 item length, i32 quantity, city, item.
+// -----------------------------------------------------------------------------
+const char DELTA_FILE[] = "inventory.deltas";
+const char DELTA_OLD_FILE[] = "inventory.deltas.old";  // The log being compacted.
+const char DELTA_MAGIC[] = "RDLT";
+const int DELTA_VERSION = 1;
+const size_t DELTA_HEADER_SIZE = 8;
+const size_t DELTA_RECORD_FIXED_SIZE = 12;
+const unsigned long long DELTA_COMPACT_BYTES = 64 << 10;
+
+struct DeltaLog {
+    int fd = -1;
+    bool durable = false;         // fsync after every record ("--fsync").
+    unsigned long long size = 0;  // Bytes in the file.
+    set<string> touched;          // Cities with records in the current log.
+    mutex lock;                   // Service threads append concurrently.
+};
+DeltaLog deltaLog;
+
+// Records of this thread's changes that wait for their journal records.
+struct PendingDeltas {
+    string records;
+    vector<string> cities;
+};
+thread_local PendingDeltas pendingDeltas;
+
+void encodeDelta(string &buf, const string &city, const string &item, int qty) {
+    size_t start = buf.size();
+    putLE(buf, 0, 4);
+    putLE(buf, city.size(), 2);
+    putLE(buf, item.size(), 2);
+    putLE(buf, (unsigned int)qty, 4);
+    buf += city;
+    buf += item;
+    unsigned int checksum = (unsigned int)fnv1a(buf.data() + start + 4, buf.size() - start - 4);
+    for (int i = 0; i < 4; i++)
+        buf[start + i] = (char)((checksum >> (8 * i)) & 0xFF);
+}
+
+// Decodes one record. Returns its size, or 0 if "p" does not start with a
+// complete, intact record.
+size_t decodeDelta(const char *p, size_t available, string &city, string &item, int &qty) {
+    if (available < DELTA_RECORD_FIXED_SIZE)
+        return 0;
+    size_t cityLength = getLE(p + 4, 2), itemLength = getLE(p + 6, 2);
+    size_t size = DELTA_RECORD_FIXED_SIZE + cityLength + itemLength;
+    if (available < size || getLE(p, 4) != (unsigned int)fnv1a(p + 4, size - 4))
+        return 0;
+    qty = (int)getLE(p + 8, 4);
+    city.assign(p + DELTA_RECORD_FIXED_SIZE, cityLength);
+    item.assign(p + DELTA_RECORD_FIXED_SIZE + cityLength, itemLength);
+    return size;
+}
+
+// Starts an empty log. The caller holds deltaLog.lock (or is alone).
+bool createDeltaLog() {
+    deltaLog.fd = open(DELTA_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_BINARY, 0644);
+    if (deltaLog.fd == -1) {
+        cout << "Error: could not open \"" << DELTA_FILE << "\"; allocations will not survive a crash.\n";
+        return false;
+    }
+    string header(DELTA_MAGIC, 4);
+    putLE(header, DELTA_VERSION, 2);
+    putLE(header, 0, 2);
+    deltaLog.size = write(deltaLog.fd, header.data(), header.size());
+    deltaLog.touched.clear();
+    return true;
+}
+
+// Records a city's new quantity of an item, to be written by the next
+// writePendingDeltas on this thread. Does nothing until the log is open, so
+// changes replayed from it at startup are not logged again.
+void appendDelta(const string &city, ItemId item, int qty) {
+    if (deltaLog.fd == -1)
+        return;
+    encodeDelta(pendingDeltas.records, city, itemName(item), qty);
+    pendingDeltas.cities.push_back(city);
+}
+
+// Writes this thread's held-back records. Called once the journal records of
+// their transactions are committed; service threads call it before they
+// release their cities' locks, so each city's records stay in order.
+void writePendingDeltas() {
+    if (pendingDeltas.records.empty())
+        return;
+    lock_guard<mutex> guard(deltaLog.lock);
+    if (deltaLog.fd != -1) {
+        const string &records = pendingDeltas.records;
+        if (write(deltaLog.fd, records.data(), records.size()) != (long)records.size()) {
+            cout << "Error: could not write to \"" << DELTA_FILE << "\".\n";
+        } else {
+            if (deltaLog.durable)
+                fsync(deltaLog.fd);
+            deltaLog.size += records.size();
+            deltaLog.touched.insert(pendingDeltas.cities.begin(), pendingDeltas.cities.end());
+        }
+    }
+    pendingDeltas.records.clear();
+    pendingDeltas.cities.clear();
+}
+
+// -----------------------------------------------------------------------------
+// Log successful allocation transactions to the journal. They are committed
+// before this returns, and only then are the inventory deltas of the changes
+// they describe written.
+// -----------------------------------------------------------------------------
+void logTransactions(const vector<Transaction> &transactions) {
+    long long now = (long long)time(0);
+    unique_lock<mutex> guard(journal.lock);
+    unsigned long long end = journal.size;
+    for (auto t : transactions) {
+        t.time = now;
+        end = bufferJournalRecord(t);
+        if (journal.buffer.size() >= JOURNAL_COMMIT_BYTES)
+            commitJournalThrough(guard, end);
+    }
+    commitJournalThrough(guard, end);
+    guard.unlock();
+    writePendingDeltas();
+}
+
+void logTransaction(const string &donor, const string &recipient, const string &item, int quantity) {
+    logTransactions({makeTransaction(donor, recipient, item, quantity)});
+}
+
+// -----------------------------------------------------------------------------
+// City registry and lazy loading.
+// Every registered city has an entry in cityRegistry, but only recently used
+// cities keep their records in cityData. Records are loaded on first access
+// (from the inventory snapshot, or from <city>.txt), and the least recently
+// used cities are evicted once their records exceed cityMemoryBudget. Per-city
+// aggregates (the donor index, the city summaries and the Metro Manila
+// totals) stay resident, so donor lookups and metro totals never need an
+// evicted city's records. A changed city is written back to <city>.txt when
+// it is evicted.
+// -----------------------------------------------------------------------------
+size_t estimateRecordBytes(const vector<Supply> &supplies) {
+    return sizeof(vector<Supply>) + supplies.capacity() * sizeof(Supply);
+}
+
+bool isRegistered(const string &city) {
+    return cityRegistry.find(city) != cityRegistry.end();
+}
+
+void touchCity(CityInfo &info, const string &city) {
+    residentCities.erase(info.lruPosition);
+    residentCities.push_front(city);
+    info.lruPosition = residentCities.begin();
+}
+
+// Puts a city's records in memory as its most recently used entry.
+void makeResident(const string &city, CityInfo &info, vector<Supply> &&supplies) {
+    if (info.resident) {
+        cityMemoryUsed -= info.residentBytes;
+        residentCities.erase(info.lruPosition);
+    }
+    vector<Supply> &records = cityData[city];
+    records = move(supplies);
+    info.resident = true;
+    info.residentBytes = estimateRecordBytes(records);
+    cityMemoryUsed += info.residentBytes;
+    residentCities.push_front(city);
+    info.lruPosition = residentCities.begin();
+}
+
+// Registers a city (or replaces its records) with freshly loaded records whose
+// source is its text file.
+void registerCity(const string &city, vector<Supply> &&supplies) {
+    CityInfo &info = cityRegistry[city];
+    info.dirty = false;
+    info.inSnapshot = false;
+    info.itemCount = supplies.size();
+    info.totalUnits = 0;
+    for (auto &s : supplies)
+        info.totalUnits += s.quantity;
+    makeResident(city, info, move(supplies));
+}
+
+// The contents of a <city>.txt file holding "supplies".
+string cityFileText(const vector<Supply> &supplies) {
+    string text;
+    for (const Supply *s : byItemName(supplies)) {
+        text += itemName(s->itemId) + " " + to_string(s->quantity) + "\n";
+    }
+    return text;
+}
+
+void writeCityFile(const string &city, const vector<Supply> &supplies) {
+    if (!writeFileAtomically(city + ".txt", cityFileText(supplies)))
+        cout << "Error: could not write \"" << city << ".txt\".\n";
+}
+
+// Returns a city's records, loading them if needed, or nullptr if the city is
+// not registered or its records cannot be read (the city then stays
+// non-resident, so nothing is saved over its files). The pointer stays valid
+// until the next call to enforceCityMemoryBudget. While the allocation
+// service runs every city is loaded and the LRU order is left alone, so this
+// only reads shared state.
+vector<Supply>* cityRecords(const string &city) {
+    auto it = cityRegistry.find(city);
+    if (it == cityRegistry.end())
+        return nullptr;
+    CityInfo &info = it->second;
+    if (info.resident) {
+        if (!serviceRunning)
+            touchCity(info, city);
+        return &cityData.find(city)->second;
+    }
+    vector<Supply> supplies;
+    if (info.inSnapshot) {
+        const char *p = snapshotView.data + info.snapshotOffset;
+        if (!decodeSupplies(p, snapshotView.data + snapshotView.size, snapshotItems, supplies)) {
+            cout << "Error: the records of \"" << city << "\" in \"" << SNAPSHOT_FILE << "\" are damaged.\n";
+            return nullptr;
+        }
+    } else {
+        vector<string> errors;
+        if (!parseCityDataset(city, supplies, errors)) {
+            cout << "Error: File \"" << city << ".txt\" not found!\n";
+            return nullptr;
+        }
+        for (auto &error : errors) {
+            cout << "Warning: " << error << " (line skipped).\n";
+        }
+    }
+    makeResident(city, info, move(supplies));
+    return &cityData[city];
+}
+
+void evictCity(const string &city) {
+    CityInfo &info = cityRegistry[city];
+    if (!info.resident)
+        return;
+    STATS_COUNT(STAT_CITIES_EVICTED, 1);
+    if (info.dirty) {
+        // Its saved copies are out of date; the text file becomes its source.
+        writeCityFile(city, cityData[city]);
+        info.dirty = false;
+        info.inSnapshot = false;
+    }
+    cityMemoryUsed -= info.residentBytes;
+    info.residentBytes = 0;
+    info.resident = false;
+    residentCities.erase(info.lruPosition);
+    cityData.erase(city);
+}
+
+// Evicts least recently used cities until the resident records fit in the
+// budget. The most recently used city is always kept. Only called between
+// operations, never while a cityRecords pointer is in use.
+void enforceCityMemoryBudget() {
+    while (cityMemoryUsed > cityMemoryBudget && residentCities.size() > 1)
+        evictCity(residentCities.back());
+}
+
+// -----------------------------------------------------------------------------
+// Dense storage mode ("--dense"). When nearly every city holds the same
+// catalog of items, quantities are kept in one matrix instead of a sorted
+// vector per city: a row per city and a column per item id. Rows are padded to
+// a multiple of 64 bytes and the matrix starts on a 64-byte boundary, so every
+// row is cache-line aligned. A city that does not hold an item has
+// DENSE_ABSENT in that cell. Lookups and updates index the matrix directly,
+// and per-item statistics (totals, min/max, cities below a threshold) are
+// computed for every item in one pass over the rows, four columns at a time
+// with SSE2 where it is available. Every city stays loaded in this mode, so
+// the memory budget does not apply.
+// -----------------------------------------------------------------------------
+const int DENSE_ABSENT = -1;  // Same as the "did not hold it" oldQty of onSupplyChanged.
+const size_t DENSE_ALIGN = 64;
+const size_t DENSE_ROW_CELLS = DENSE_ALIGN / sizeof(int);
+
+struct DenseInventory {
+    bool enabled = false;
+    vector<string> cities;     // Row -> city.
+    map<string, size_t> rows;  // City -> row.
+    size_t stride = 0;         // Cells per row, covering item ids 0..stride-1.
+    int *cells = nullptr;      // cities.size() rows of "stride" cells.
+};
+DenseInventory dense;
+
+int *allocateDenseCells(size_t count) {
+    void *memory = operator new[](max<size_t>(count, 1) * sizeof(int), align_val_t(DENSE_ALIGN));
+    int *cells = static_cast<int *>(memory);
+    fill(cells, cells + count, DENSE_ABSENT);
+    return cells;
+}
+
+void freeDenseCells(int *cells) {
+    if (cells)
+        operator delete[](cells, align_val_t(DENSE_ALIGN));
+}
+
+// Widens the rows so that item ids below "items" have a column.
+void reserveDenseColumns(size_t items) {
+    if (items <= dense.stride && dense.cells)
+        return;
+    size_t stride = max(items, dense.stride * 2);
+    stride = (stride + DENSE_ROW_CELLS - 1) / DENSE_ROW_CELLS * DENSE_ROW_CELLS;
+    int *cells = allocateDenseCells(dense.cities.size() * stride);
+    for (size_t r = 0; r < dense.cities.size(); r++) {
+        const int *row = dense.cells + r * dense.stride;
+        copy(row, row + dense.stride, cells + r * stride);
+    }
+    freeDenseCells(dense.cells);
+    dense.cells = cells;
+    dense.stride = stride;
+}
+
+int *denseRow(const string &city) {
+    auto it = dense.rows.find(city);
+    return (it != dense.rows.end()) ? dense.cells + it->second * dense.stride : nullptr;
+}
+
+// Moves every registered city's records into the matrix, one city at a time,
+// and switches to dense mode.
+void buildDenseInventory() {
+    dense.cities.clear();
+    dense.rows.clear();
+    for (auto &entry : cityRegistry) {
+        dense.rows[entry.first] = dense.cities.size();
+        dense.cities.push_back(entry.first);
+    }
+    freeDenseCells(dense.cells);
+    dense.cells = nullptr;
+    dense.stride = 0;
+    reserveDenseColumns(itemDictionary.names.size());
+    for (auto &city : dense.cities) {
+        // A city whose records cannot be read keeps an empty row, so it never
+        // has enough to donate.
+        const vector<Supply> *records = cityRecords(city);
+        if (!records)
+            continue;
+        reserveDenseColumns(itemDictionary.names.size());  // Its text file may add items.
+        int *row = denseRow(city);
+        for (auto &s : *records)
+            row[s.itemId] = s.quantity;
+        evictCity(city);
+    }
+    dense.enabled = true;
+}
+
+// Per-item statistics over the cities holding each item, indexed by item id.
+// "below" counts the holders with less than the threshold.
+struct ItemStats {
+    vector<int> total, minimum, maximum, holders, below;
+};
+
+void denseColumnStats(int threshold, ItemStats &stats) {
+    size_t n = dense.stride;
+    stats.total.assign(n, 0);
+    stats.minimum.assign(n, INT_MAX);
+    stats.maximum.assign(n, DENSE_ABSENT);
+    stats.holders.assign(n, 0);
+    stats.below.assign(n, 0);
+    for (size_t r = 0; r < dense.cities.size(); r++) {
+        const int *row = dense.cells + r * dense.stride;
+        size_t j = 0;
+#ifdef DENSE_SSE2
+        const __m128i absent = _mm_set1_epi32(DENSE_ABSENT);
+        const __m128i limit = _mm_set1_epi32(threshold);
+        const __m128i largest = _mm_set1_epi32(INT_MAX);
+        for (; j + 4 <= n; j += 4) {
+            __m128i v = _mm_load_si128(reinterpret_cast<const __m128i *>(row + j));
+            __m128i held = _mm_cmpgt_epi32(v, absent);  // All ones where the city holds the item.
+            __m128i *total = reinterpret_cast<__m128i *>(&stats.total[j]);
+            __m128i *minimum = reinterpret_cast<__m128i *>(&stats.minimum[j]);
+            __m128i *maximum = reinterpret_cast<__m128i *>(&stats.maximum[j]);
+            __m128i *holders = reinterpret_cast<__m128i *>(&stats.holders[j]);
+            __m128i *below = reinterpret_cast<__m128i *>(&stats.below[j]);
+            _mm_storeu_si128(total, _mm_add_epi32(_mm_loadu_si128(total), _mm_and_si128(v, held)));
+            _mm_storeu_si128(holders, _mm_sub_epi32(_mm_loadu_si128(holders), held));
+            __m128i isBelow = _mm_and_si128(held, _mm_cmplt_epi32(v, limit));
+            _mm_storeu_si128(below, _mm_sub_epi32(_mm_loadu_si128(below), isBelow));
+            // SSE2 has no 32-bit min/max, so select with compare masks. Absent
+            // cells count as INT_MAX for the minimum; for the maximum they are
+            // already smaller than any quantity.
+            __m128i candidate = _mm_or_si128(_mm_and_si128(held, v), _mm_andnot_si128(held, largest));
+            __m128i low = _mm_loadu_si128(minimum);
+            __m128i smaller = _mm_cmplt_epi32(candidate, low);
+            _mm_storeu_si128(minimum, _mm_or_si128(_mm_and_si128(smaller, candidate), _mm_andnot_si128(smaller, low)));
+            __m128i high = _mm_loadu_si128(maximum);
+            __m128i larger = _mm_cmpgt_epi32(v, high);
+            _mm_storeu_si128(maximum, _mm_or_si128(_mm_and_si128(larger, v), _mm_andnot_si128(larger, high)));
+        }
+#endif
+        for (; j < n; j++) {
+            int v = row[j];
+            if (v == DENSE_ABSENT)
+                continue;
+            stats.total[j] += v;
+            stats.holders[j]++;
+            stats.below[j] += (v < threshold);
+            stats.minimum[j] = min(stats.minimum[j], v);
+            stats.maximum[j] = max(stats.maximum[j], v);
+        }
+    }
+}
+
+// The same statistics from the donor index, for the default storage mode.
+void indexItemStats(int threshold, ItemStats &stats) {
+    size_t n = donorIndex.size();
+    stats.total.assign(n, 0);
+    stats.minimum.assign(n, INT_MAX);
+    stats.maximum.assign(n, DENSE_ABSENT);
+    stats.holders.assign(n, 0);
+    stats.below.assign(n, 0);
+    for (ItemId item = 0; item < n; item++) {
+        const set<pair<int, string>> &holders = donorIndex[item];
+        if (holders.empty())
+            continue;
+        for (auto &holder : holders)
+            stats.total[item] += holder.first;
+        stats.minimum[item] = holders.begin()->first;
+        stats.maximum[item] = holders.rbegin()->first;
+        stats.holders[item] = holders.size();
+        stats.below[item] = distance(holders.begin(), holders.lower_bound({threshold, string()}));
+    }
+}
+
+void itemStats(int threshold, ItemStats &stats) {
+    if (dense.enabled)
+        denseColumnStats(threshold, stats);
+    else
+        indexItemStats(threshold, stats);
+}
+
+// Returns (city, quantity) for every city holding less than "threshold" of
+// "item", smallest quantity first.
+vector<pair<string, int>> citiesBelow(ItemId item, int threshold) {
+    vector<pair<int, string>> found;
+    if (dense.enabled) {
+        for (size_t r = 0; item < dense.stride && r < dense.cities.size(); r++) {
+            int v = dense.cells[r * dense.stride + item];
+            if (v != DENSE_ABSENT && v < threshold)
+                found.push_back({v, dense.cities[r]});
+        }
+        sort(found.begin(), found.end());
+    } else if (item < donorIndex.size()) {
+        for (auto &holder : donorIndex[item]) {
+            if (holder.first >= threshold)
+                break;
+            found.push_back(holder);
+        }
+    }
+    vector<pair<string, int>> cities;
+    for (auto &f : found)
+        cities.push_back({f.second, f.first});
+    return cities;
+}
+
+// Recomputes the Metro Manila totals from the matrix columns.
+void rebuildMetroFromDense() {
+    STATS_TIME(STAT_CONSOLIDATE);
+    ItemStats stats;
+    denseColumnStats(0, stats);
+    metroManilaData.clear();
+    for (ItemId item = 0; item < stats.total.size(); item++) {
+        if (stats.holders[item] > 0)
+            metroManilaData.push_back({item, stats.total[item]});
+    }
+    metroPendingChanges++;
+}
+
+// -----------------------------------------------------------------------------
+// Record access for the menu and allocation code, in either storage mode.
+// -----------------------------------------------------------------------------
+// Sets "qty" to a registered city's quantity of "item". Returns false if the
+// city does not hold the item.
+bool cityQuantity(const string &city, ItemId item, int &qty) {
+    if (dense.enabled) {
+        const int *row = denseRow(city);
+        if (!row || item >= dense.stride || row[item] == DENSE_ABSENT)
+            return false;
+        qty = row[item];
+        return true;
+    }
+    vector<Supply> *records = cityRecords(city);
+    Supply *s = records ? findSupply(*records, item) : nullptr;
+    if (!s)
+        return false;
+    qty = s->quantity;
+    return true;
+}
+
+// Sets a registered city's quantity of "item", adding the item if the city
+// did not hold it, and keeps the derived structures in step. Returns false
+// (and changes nothing) if the city's records cannot be loaded.
+bool setCityQuantity(const string &city, ItemId item, int qty) {
+    int oldQty = -1;
+    if (dense.enabled) {
+        reserveDenseColumns(item + 1);
+        int &cell = denseRow(city)[item];
+        oldQty = cell;
+        cell = qty;
+    } else {
+        vector<Supply> *records = cityRecords(city);
+        if (!records)
+            return false;
+        Supply *s = findSupply(*records, item);
+        if (s) {
+            oldQty = s->quantity;
+            s->quantity = qty;
+        } else {
+            insertSupply(*records, item, qty);
+        }
+    }
+    onSupplyChanged(city, item, oldQty, qty);
+    appendDelta(city, item, qty);
+    return true;
+}
+
+// A copy of a registered city's records, sorted by item id (empty if they
+// cannot be loaded).
+vector<Supply> citySupplies(const string &city) {
+    if (!dense.enabled) {
+        vector<Supply> *records = cityRecords(city);
+        return records ? *records : vector<Supply>();
+    }
+    vector<Supply> supplies;
+    const int *row = denseRow(city);
+    for (ItemId item = 0; item < dense.stride; item++) {
+        if (row[item] != DENSE_ABSENT)
+            supplies.push_back({item, row[item]});
+    }
+    return supplies;
+}
+
+// -----------------------------------------------------------------------------
+// Loads a single city's dataset from its file and registers it in the system.
+// -----------------------------------------------------------------------------
+void loadCityDataset(const string &city) {
+    vector<Supply> supplies;
+    vector<string> errors;
+    if (!parseCityDataset(city, supplies, errors)) {
+        cout << "Error: File \"" << city << ".txt\" not found!\n";
+        return;
+    }
+    for (auto &error : errors) {
+        cout << "Warning: " << error << " (line skipped).\n";
+    }
+    registerCity(city, move(supplies));
+    cout << "City \"" << city << "\" dataset loaded.\n";
+}
+
+// -----------------------------------------------------------------------------
+// Loads several cities in parallel. A pool of worker threads takes cities off
+// a shared counter and parses/sorts them into their own slots; the results
+// are then registered in one pass on the calling thread.
+// -----------------------------------------------------------------------------
+void loadCityDatasets(const vector<string> &cities) {
+    vector<vector<Supply>> results(cities.size());
+    vector<vector<string>> errors(cities.size());
+    vector<char> found(cities.size(), 0);
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < cities.size(); i = next++)
+            found[i] = parseCityDataset(cities[i], results[i], errors[i]);
+    };
+    size_t threadCount = min<size_t>(max(1u, thread::hardware_concurrency()), cities.size());
+    vector<thread> pool;
+    for (size_t t = 1; t < threadCount; t++)
+        pool.emplace_back(worker);
+    worker();  // The calling thread works too.
+    for (auto &t : pool)
+        t.join();
+
+    for (size_t i = 0; i < cities.size(); i++) {
+        if (!found[i]) {
+            cout << "Error: File \"" << cities[i] << ".txt\" not found!\n";
+            continue;
+        }
+        for (auto &error : errors[i]) {
+            cout << "Warning: " << error << " (line skipped).\n";
+        }
+        registerCity(cities[i], move(results[i]));
+        cout << "City \"" << cities[i] << "\" dataset loaded.\n";
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Automatically register (load) all cities from their text files.
+// -----------------------------------------------------------------------------
+void registerAllCities() {
+    loadCityDatasets(discoverCities());
+    updateRegisteredCitiesFile();
+    updateMetroManilaData();
+    rebuildDonorIndex();
+}
+
+// True if "a" exists and was modified after "b" (or "b" does not exist).
+bool fileIsNewer(const string &a, const string &b) {
+    error_code errA, errB;
+    auto timeA = filesystem::last_write_time(a, errA);
+    auto timeB = filesystem::last_write_time(b, errB);
+    return !errA && (errB || timeA > timeB);
+}
+
+// -----------------------------------------------------------------------------
+// Delta log compaction. Between operations (every second while the allocation
+// service runs), once the log has passed DELTA_COMPACT_BYTES, it is renamed
+// to DELTA_OLD_FILE and a new one is started; a background thread then
+// rewrites the <city>.txt file of every city in the old log (each atomically,
+// by rename) and removes the old log.
+// Those text files are newer than the snapshot, so a restart loads them
+// instead of the snapshot's copies of those cities. If the file system's
+// timestamps are too coarse to tell a text file from the snapshot, the old
+// log is kept and replayed instead, and no further compaction starts until
+// the next snapshot save removes it.
+// -----------------------------------------------------------------------------
+struct DeltaCompaction {
+    thread worker;
+    bool running = false;
+    atomic<bool> finished{false};
+};
+DeltaCompaction deltaCompaction;
+
+void finishDeltaCompaction() {
+    if (!deltaCompaction.running)
+        return;
+    deltaCompaction.worker.join();
+    deltaCompaction.running = false;
+}
+
+void compactDeltasIfDue() {
+    if (deltaCompaction.running && deltaCompaction.finished)
+        finishDeltaCompaction();
+    if (deltaCompaction.running || deltaLog.fd == -1 || deltaLog.size < DELTA_COMPACT_BYTES ||
+        filesystem::exists(DELTA_OLD_FILE))
+        return;
+    // The files' contents are built here: the worker does not touch the
+    // inventory or the item dictionary.
+    vector<pair<string, string>> files;
+    for (auto &city : deltaLog.touched) {
+        if (isRegistered(city) && (dense.enabled || cityRecords(city)))
+            files.push_back({city + ".txt", cityFileText(citySupplies(city))});
+    }
+    {
+        lock_guard<mutex> guard(deltaLog.lock);
+        close(deltaLog.fd);
+        deltaLog.fd = -1;
+        if (rename(DELTA_FILE, DELTA_OLD_FILE) != 0 || !createDeltaLog()) {
+            deltaLog.fd = open(DELTA_FILE, O_WRONLY | O_APPEND | O_BINARY);
+            return;
+        }
+    }
+    deltaCompaction.finished = false;
+    deltaCompaction.running = true;
+    deltaCompaction.worker = thread([files]() {
+        bool replaced = true;
+        for (auto &file : files) {
+            replaced = writeFileAtomically(file.first, file.second) && fileIsNewer(file.first, SNAPSHOT_FILE) &&
+                       replaced;
+        }
+        if (replaced)
+            remove(DELTA_OLD_FILE);
+        deltaCompaction.finished = true;
+    });
+}
+
+// Empties the log once the snapshot holds everything in it.
+void resetDeltaLog() {
+    finishDeltaCompaction();
+    remove(DELTA_OLD_FILE);
+    lock_guard<mutex> guard(deltaLog.lock);
+    if (deltaLog.fd == -1) {
+        remove(DELTA_FILE);
+        return;
+    }
+    if (ftruncate(deltaLog.fd, DELTA_HEADER_SIZE) == 0)
+        deltaLog.size = DELTA_HEADER_SIZE;
+    if (deltaLog.durable)
+        fsync(deltaLog.fd);
+    deltaLog.touched.clear();
+}
+
+// Replays what is left of an interrupted compaction and then the current log
+// on top of the loaded inventory, and opens the log for appending (cutting
+// off a record left half written by a crash). Returns how many records
+// changed a quantity.
+size_t openDeltaLog(bool durable) {
+    deltaLog.durable = durable;
+    size_t changed = 0;
+    unsigned long long validEnd = 0;
+    const char *files[] = {DELTA_OLD_FILE, DELTA_FILE};
+    for (int current = 0; current < 2; current++) {
+        MappedFile file;
+        if (!mapFile(files[current], file))
+            continue;
+        size_t pos = 0;
+        if (file.size >= DELTA_HEADER_SIZE && memcmp(file.data, DELTA_MAGIC, 4) == 0 &&
+            (int)getLE(file.data + 4, 2) == DELTA_VERSION) {
+            pos = DELTA_HEADER_SIZE;
+            string city, item;
+            int qty;
+            while (size_t used = decodeDelta(file.data + pos, file.size - pos, city, item, qty)) {
+                pos += used;
+                if (!isRegistered(city))
+                    continue;
+                if (current)
+                    deltaLog.touched.insert(city);
+                ItemId id = internItem(item);
+                int held;
+                if ((!cityQuantity(city, id, held) || held != qty) && setCityQuantity(city, id, qty))
+                    changed++;
+            }
+        }
+        if (current)
+            validEnd = pos;
+        unmapFile(file);
+    }
+    if (validEnd < DELTA_HEADER_SIZE) {
+        createDeltaLog();
+        return changed;
+    }
+    deltaLog.fd = open(DELTA_FILE, O_WRONLY | O_APPEND | O_BINARY);
+    if (deltaLog.fd == -1 || ftruncate(deltaLog.fd, validEnd) != 0) {
+        cout << "Error: could not open \"" << DELTA_FILE << "\"; allocations will not survive a crash.\n";
+        return changed;
+    }
+    deltaLog.size = validEnd;
+    return changed;
+}
+
+// Writes every registered city to a new snapshot. Resident cities are encoded
+// from memory, cities still in the old snapshot are re-encoded from it (their
+// records are copied as they are when the old item numbers are already the
+// interned ids), and the rest are read from their text files. Afterwards the
+// new snapshot is mapped and becomes the source for every city. If a city's
+// records cannot be read the old snapshot is kept, so it is never saved empty.
+bool saveInventorySnapshot() {
+    string payload;
+    vector<pair<size_t, size_t>> locations;  // Offset and length of each city's records.
+    bool sameItemNumbers = true;
+    for (size_t i = 0; i < snapshotItems.size() && sameItemNumbers; i++)
+        sameItemNumbers = (snapshotItems[i] == i);
+    // Text files may intern new items, so the cities are encoded first and
+    // the item table is put in front of them at the end.
+    putLE(payload, cityRegistry.size(), 4);
+    for (auto &entry : cityRegistry) {
+        const string &city = entry.first;
+        CityInfo &info = entry.second;
+        putLE(payload, city.size(), 2);
+        payload += city;
+        size_t start = payload.size();
+        if (dense.enabled) {
+            encodeSupplies(payload, citySupplies(city));
+        } else if (info.resident) {
+            encodeSupplies(payload, cityData[city]);
+        } else if (info.inSnapshot && sameItemNumbers) {
+            payload.append(snapshotView.data + info.snapshotOffset, info.snapshotLength);
+        } else if (info.inSnapshot) {
+            vector<Supply> supplies;
+            const char *p = snapshotView.data + info.snapshotOffset;
+            if (!decodeSupplies(p, snapshotView.data + snapshotView.size, snapshotItems, supplies)) {
+                cout << "Error: the records of \"" << city << "\" in \"" << SNAPSHOT_FILE << "\" are damaged; "
+                     << "the snapshot was not saved.\n";
+                return false;
+            }
+            encodeSupplies(payload, supplies);
+        } else {
+            vector<Supply> supplies;
+            vector<string> errors;
+            if (!parseCityDataset(city, supplies, errors)) {
+                cout << "Error: File \"" << city << ".txt\" not found; the snapshot was not saved.\n";
+                return false;
+            }
+            encodeSupplies(payload, supplies);
+        }
+        locations.push_back({start, payload.size() - start});
+    }
+    encodeSupplies(payload, metroManilaData);
+
+    string items;
+    size_t itemCount = itemDictionary.names.size();
+    putLE(items, itemCount, 4);
+    for (size_t id = 0; id < itemCount; id++) {
+        putLE(items, itemDictionary.names[id].size(), 2);
+        items += itemDictionary.names[id];
+    }
+    payload.insert(0, items);
+
+    string file(SNAPSHOT_MAGIC, 4);
+    putLE(file, SNAPSHOT_VERSION, 2);
+    putLE(file, 0, 2);
+    putLE(file, payload.size(), 8);
+    putLE(file, fnv1a(payload.data(), payload.size()), 8);
+    file += payload;
+    if (!writeFileAtomically(SNAPSHOT_FILE, file)) {
+        cout << "Error: could not write \"" << SNAPSHOT_FILE << "\".\n";
+        return false;
+    }
+    resetDeltaLog();
+
+    unmapFile(snapshotView);
+    if (!mapFile(SNAPSHOT_FILE, snapshotView)) {
+        // Keep going from memory and the text files.
+        for (auto &entry : cityRegistry)
+            entry.second.inSnapshot = false;
+        return true;
+    }
+    snapshotItems.resize(itemCount);
+    for (size_t id = 0; id < itemCount; id++)
+        snapshotItems[id] = id;
+    size_t i = 0;
+    for (auto &entry : cityRegistry) {
+        CityInfo &info = entry.second;
+        info.snapshotOffset = SNAPSHOT_HEADER_SIZE + items.size() + locations[i].first;
+        info.snapshotLength = locations[i].second;
+        info.inSnapshot = true;
+        info.dirty = false;
+        i++;
+    }
+    return true;
+}
+
+// True if a mapped snapshot file has the right header and checksum.
+bool snapshotIntact(const MappedFile &file) {
+    const char *p = file.data;
+    return file.size >= SNAPSHOT_HEADER_SIZE && memcmp(p, SNAPSHOT_MAGIC, 4) == 0 &&
+           (int)getLE(p + 4, 2) == SNAPSHOT_VERSION &&
+           getLE(p + 8, 8) == file.size - SNAPSHOT_HEADER_SIZE &&
+           getLE(p + 16, 8) == fnv1a(p + SNAPSHOT_HEADER_SIZE, file.size - SNAPSHOT_HEADER_SIZE);
+}
+
+// Registers the cities in the snapshot (plus any new names in
+// "registered_cities.txt") without loading their records: one pass over the
+// mapped snapshot builds the donor index and the city summaries. A city whose
+// text file is newer than the snapshot is loaded from the text file instead.
+// Returns false, leaving memory untouched, if there is no valid snapshot.
+bool loadInventorySnapshot() {
+    MappedFile file;
+    if (!mapFile(SNAPSHOT_FILE, file))
+        return false;
+    const char *p = file.data, *end = file.data + file.size;
+    bool ok = snapshotIntact(file);
+    if (!ok) {
+        cout << "Warning: \"" << SNAPSHOT_FILE << "\" is damaged or from another version; ignoring it.\n";
+        unmapFile(file);
+        return false;
+    }
+    p += SNAPSHOT_HEADER_SIZE;
+    vector<ItemId> items;
+    size_t itemCount = (end - p >= 4) ? getLE(p, 4) : 0;
+    ok = end - p >= 4;
+    p += 4;
+    for (size_t i = 0; i < itemCount && ok; i++) {
+        size_t len = (end - p >= 2) ? getLE(p, 2) : 0;
+        ok = end - p >= (long)(2 + len);
+        if (ok)
+            items.push_back(internItem(string_view(p + 2, len)));
+        p += 2 + len;
+    }
+    map<string, CityInfo> registry;
+    vector<set<pair<int, string>>> index(itemDictionary.names.size());
+    vector<Supply> metro;
+    vector<string> fromText;  // Cities to load from their text files instead.
+    size_t cityCount = (ok && end - p >= 4) ? getLE(p, 4) : 0;
+    ok = ok && end - p >= 4;
+    p += 4;
+    for (size_t i = 0; i < cityCount && ok; i++) {
+        size_t len = (end - p >= 2) ? getLE(p, 2) : 0;
+        ok = end - p >= (long)(2 + len + 4) && len > 0;
+        if (!ok)
+            break;
+        string city(p + 2, len);
+        p += 2 + len;
+        bool edited = fileIsNewer(city + ".txt", SNAPSHOT_FILE);
+        if (edited)
+            fromText.push_back(city);
+        CityInfo &info = registry[city];
+        info.inSnapshot = !edited;
+        info.snapshotOffset = p - file.data;
+        size_t count = getLE(p, 4);
+        p += 4;
+        ok = (size_t)(end - p) / SNAPSHOT_RECORD_SIZE >= count;
+        for (size_t j = 0; j < count && ok; j++, p += SNAPSHOT_RECORD_SIZE) {
+            size_t number = getLE(p, 4);
+            ok = number < items.size();
+            int qty = (int)getLE(p + 4, 4);
+            if (ok && !edited) {
+                index[items[number]].insert({qty, city});
+                info.itemCount++;
+                info.totalUnits += qty;
+            }
+        }
+        info.snapshotLength = (p - file.data) - info.snapshotOffset;
+    }
+    ok = ok && decodeSupplies(p, end, items, metro);
+    if (!ok) {
+        unmapFile(file);
+        return false;
+    }
+
+    cityData.clear();
+    residentCities.clear();
+    cityMemoryUsed = 0;
+    cityRegistry.swap(registry);
+    donorIndex.swap(index);
+    metroManilaData.swap(metro);
+    snapshotItems.swap(items);
+    unmapFile(snapshotView);
+    snapshotView = move(file);
+    if (!snapshotView.mapped)
+        snapshotView.data = snapshotView.buffer.data();
+
+    cout << "Inventory loaded from \"" << SNAPSHOT_FILE << "\" (" << cityRegistry.size() << " cities).\n";
+
+    // Cities added to "registered_cities.txt", and cities whose text file was
+    // edited after the snapshot, are loaded from their text files.
+    size_t knownCities = cityRegistry.size();
+    for (auto &city : discoverCities()) {
+        if (!isRegistered(city))
+            fromText.push_back(city);
+    }
+    if (!fromText.empty()) {
+        loadCityDatasets(fromText);
+        for (auto &city : fromText) {
+            if (cityData.count(city))
+                addCityToDonorIndex(city, cityData[city]);
+        }
+        rebuildMetroFromDonorIndex();
+        if (cityRegistry.size() != knownCities)
+            updateRegisteredCitiesFile();
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Option: Export every city's current dataset back to its <city>.txt file.
+// -----------------------------------------------------------------------------
+void exportCityDatasets() {
+    for (auto &entry : cityRegistry) {
+        const string &city = entry.first;
+        if (!dense.enabled && !cityRecords(city))
+            continue;  // Its file is left as it is.
+        writeCityFile(city, citySupplies(city));
+        entry.second.dirty = false;
+        cout << "Exported \"" << city << ".txt\".\n";
+        enforceCityMemoryBudget();
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Inventory checkpoints ("checkpoints/<time>_<journal offset>.snap"), for
+// point-in-time queries. A checkpoint is the inventory snapshot as it was
+// when every journal record before "journal offset" had been applied and
+// nothing after it. Taking one saves the snapshot and hard-links it into the
+// checkpoint directory (copying it where links are not supported), so it
+// costs no more than a snapshot save; later saves replace inventory.snap by
+// renaming, which leaves the linked copy alone.
+// A checkpoint is taken at startup when the state did not come entirely
+// from the snapshot (imported or edited text files are not in the journal),
+// and then between operations (every second while the allocation service
+// runs) once the journal has grown since the last one and either
+// CHECKPOINT_SECONDS have passed or CHECKPOINT_JOURNAL_BYTES have been
+// written. The newest CHECKPOINT_KEEP checkpoints are kept.
+// -----------------------------------------------------------------------------
+const char CHECKPOINT_DIR[] = "checkpoints";
+const long long CHECKPOINT_SECONDS = 3600;
+const unsigned long long CHECKPOINT_JOURNAL_BYTES = 256 << 10;
+const size_t CHECKPOINT_KEEP = 240;
+
+struct Checkpoint {
+    long long time;
+    unsigned long long journalOffset;
+    string filename;
+};
+
+// The checkpoints on disk, oldest first.
+vector<Checkpoint> listCheckpoints() {
+    vector<Checkpoint> checkpoints;
+    error_code err;
+    for (filesystem::directory_iterator it(CHECKPOINT_DIR, err), end; !err && it != end; it.increment(err)) {
+        string name = it->path().filename().string();
+        Checkpoint c;
+        int used = 0;
+        if (sscanf(name.c_str(), "%lld_%llu.snap%n", &c.time, &c.journalOffset, &used) == 2 &&
+            used == (int)name.size()) {
+            c.filename = it->path().string();
+            checkpoints.push_back(c);
+        }
+    }
+    sort(checkpoints.begin(), checkpoints.end(), [](const Checkpoint &a, const Checkpoint &b) {
+        return a.journalOffset != b.journalOffset ? a.journalOffset < b.journalOffset : a.time < b.time;
+    });
+    return checkpoints;
+}
+
+bool writeCheckpoint() {
+    commitJournal();
+    if (journal.fd == -1 || !saveInventorySnapshot())
+        return false;
+    error_code err;
+    filesystem::create_directories(CHECKPOINT_DIR, err);
+    string filename = string(CHECKPOINT_DIR) + "/" + to_string((long long)time(0)) + "_" +
+                      to_string(journal.size) + ".snap";
+    filesystem::remove(filename, err);
+    filesystem::create_hard_link(SNAPSHOT_FILE, filename, err);
+    if (err)
+        filesystem::copy_file(SNAPSHOT_FILE, filename, err);
+    if (err) {
+        cout << "Error: could not write checkpoint \"" << filename << "\".\n";
+        return false;
+    }
+    vector<Checkpoint> checkpoints = listCheckpoints();
+    for (size_t i = 0; i + CHECKPOINT_KEEP < checkpoints.size(); i++)
+        filesystem::remove(checkpoints[i].filename, err);
+    return true;
+}
+
+// Takes a checkpoint if one is due (always, with "force"). Returns true if it
+// took one, which also saved the snapshot.
+bool checkpointIfDue(bool force) {
+    commitJournal();
+    vector<Checkpoint> checkpoints = listCheckpoints();
+    bool due = force || checkpoints.empty();
+    if (!due) {
+        const Checkpoint &last = checkpoints.back();
+        due = journal.size > last.journalOffset &&
+              ((long long)time(0) - last.time >= CHECKPOINT_SECONDS ||
+               journal.size - last.journalOffset >= CHECKPOINT_JOURNAL_BYTES);
+    }
+    return due && writeCheckpoint();
+}
+
+// -----------------------------------------------------------------------------
+// Point-in-time inventory: what the cities held at a past time. The state is
+// rebuilt from the newest checkpoint taken at or before that time, by
+// applying the journal records written after the checkpoint up to the time.
+// For a time before the oldest checkpoint, the oldest checkpoint (or, with no
+// checkpoints at all, the current inventory) is taken back instead, by
+// undoing the records written after the time. Only the journal buckets that
+// can hold matching records are read (see the sparse journal index), and for
+// a single city only the buckets that city appears in.
+// -----------------------------------------------------------------------------
+typedef map<string, map<string, int>> InventoryView;  // City -> item -> quantity.
+
+// Reads the cities of a checkpoint (only "onlyCity", unless it is empty).
+bool readCheckpoint(const string &filename, const string &onlyCity, InventoryView &view) {
+    MappedFile file;
+    if (!mapFile(filename, file))
+        return false;
+    bool ok = snapshotIntact(file);
+    const char *p = file.data + SNAPSHOT_HEADER_SIZE, *end = file.data + file.size;
+    vector<string> names;
+    size_t itemCount = (ok && end - p >= 4) ? getLE(p, 4) : 0;
+    p += 4;
+    for (size_t i = 0; i < itemCount && ok; i++) {
+        size_t len = (end - p >= 2) ? getLE(p, 2) : 0;
+        ok = end - p >= (long)(2 + len);
+        if (ok)
+            names.emplace_back(p + 2, len);
+        p += 2 + len;
+    }
+    vector<ItemId> numbers(names.size());
+    for (size_t i = 0; i < numbers.size(); i++)
+        numbers[i] = i;
+    size_t cityCount = (ok && end - p >= 4) ? getLE(p, 4) : 0;
+    p += 4;
+    vector<Supply> supplies;
+    for (size_t i = 0; i < cityCount && ok; i++) {
+        size_t len = (end - p >= 2) ? getLE(p, 2) : 0;
+        ok = end - p >= (long)(2 + len);
+        if (!ok)
+            break;
+        string city(p + 2, len);
+        p += 2 + len;
+        ok = decodeSupplies(p, end, numbers, supplies);
+        if (ok && (onlyCity.empty() || city == onlyCity)) {
+            map<string, int> &items = view[city];
+            for (auto &s : supplies)
+                items[names[s.itemId]] = s.quantity;
+        }
+    }
+    unmapFile(file);
+    return ok;
+}
+
+// Applies (sign 1) or undoes (sign -1) the journal records at offsets in
+// [fromOffset, toOffset) with times in [fromTime, toTime] that involve
+// "onlyCity" (any city, if it is empty). Returns how many it used.
+size_t replayJournal(InventoryView &view, const string &onlyCity, unsigned long long fromOffset,
+                     unsigned long long toOffset, long long fromTime, long long toTime, int sign) {
+    HistoryQuery q;
+    q.city = onlyCity;
+    q.fromTime = fromTime;
+    q.toTime = toTime;
+    size_t used = 0;
+    // A shard's journal also names the cities of other shards.
+    auto apply = [&](const string &city, const string &item, int delta) {
+        if ((onlyCity.empty() || city == onlyCity) && isRegistered(city))
+            view[city][item] += delta;
+    };
+    for (unsigned int id : candidateBuckets(q)) {
+        const vector<JournalBucket> &buckets = journalIndex.buckets;
+        unsigned long long begin = max(buckets[id].offset, fromOffset);
+        unsigned long long end = (id + 1 < buckets.size()) ? buckets[id + 1].offset : journalIndex.indexedBytes;
+        end = min(end, toOffset);
+        if (begin >= end)
+            continue;
+        readJournalRegion(begin, end - begin, [&](const Transaction &t, unsigned long long, size_t) {
+            if (t.time < fromTime || t.time > toTime || !matchesQuery(t, q))
+                return;
+            apply(t.donor, t.item, -sign * t.quantity);
+            apply(t.recipient, t.item, sign * t.quantity);
+            used++;
+        });
+    }
+    return used;
+}
+
+// Rebuilds the inventory of "onlyCity" (every city, if it is empty) as of
+// "asOf". "source" describes where it was rebuilt from.
+bool inventoryAsOf(const string &onlyCity, long long asOf, InventoryView &view, string &source) {
+    commitJournal();
+    view.clear();
+    vector<Checkpoint> checkpoints = listCheckpoints();
+    const Checkpoint *before = nullptr, *after = nullptr;
+    for (auto &c : checkpoints) {
+        if (c.time <= asOf)
+            before = &c;
+        else if (!after)
+            after = &c;
+    }
+    size_t replayed;
+    if (before) {
+        if (!readCheckpoint(before->filename, onlyCity, view))
+            return false;
+        replayed = replayJournal(view, onlyCity, before->journalOffset, ULLONG_MAX, LLONG_MIN, asOf, 1);
+        source = "checkpoint of " + formatTime(before->time) + ", " + to_string(replayed) + " record(s) applied";
+    } else if (after) {
+        if (!readCheckpoint(after->filename, onlyCity, view))
+            return false;
+        replayed = replayJournal(view, onlyCity, 0, after->journalOffset, asOf + 1, LLONG_MAX, -1);
+        source = "checkpoint of " + formatTime(after->time) + ", " + to_string(replayed) + " record(s) undone";
+    } else {
+        for (auto &entry : cityRegistry) {
+            if (!onlyCity.empty() && entry.first != onlyCity)
+                continue;
+            map<string, int> &items = view[entry.first];
+            for (auto &s : citySupplies(entry.first))
+                items[itemName(s.itemId)] = s.quantity;
+        }
+        replayed = replayJournal(view, onlyCity, 0, ULLONG_MAX, asOf + 1, LLONG_MAX, -1);
+        source = "current inventory, " + to_string(replayed) + " record(s) undone";
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Saves everything that is written lazily and closes the journal. Called on
+// every way out of the program.
+// -----------------------------------------------------------------------------
+void shutdownSystem() {
+    flushMetroManilaData(true);
+    if (!checkpointIfDue(false))
+        saveInventorySnapshot();
+    closeJournal();
+    if (saveStatsOnExit && !saveStats())
+        cout << "Error: could not write \"" << STATS_FILE << "\".\n";
+}
+
+// -----------------------------------------------------------------------------
+// Moves "quantity" of "item" from donor to recipient in memory. The caller has
+// already checked that both cities are registered and the donor has enough;
+// this still refuses (changing nothing) if either city's records cannot be
+// loaded. Returns an error message, or "" on success.
+// -----------------------------------------------------------------------------
+string transferSupply(const string &donor, const string &recipient, const string &itemText, int quantity) {
+    STATS_TIME(STAT_ALLOCATE);
+    ItemId item = internItem(itemText);
+    int donorQty = 0, recipientQty = 0;
+    if (!cityQuantity(donor, item, donorQty) || donorQty < quantity)
+        return "donor city \"" + donor + "\" does not have enough \"" + itemText + "\"";
+    if (!dense.enabled && !cityRecords(recipient))
+        return "the records of \"" + recipient + "\" cannot be loaded";
+    setCityQuantity(donor, item, donorQty - quantity);
+    cityQuantity(recipient, item, recipientQty);
+    setCityQuantity(recipient, item, recipientQty + quantity);
+    return "";
+}
+
+// -----------------------------------------------------------------------------
+// Split allocation solver. Plans a batch of "recipient item qty" requests,
+// letting a request draw from several donors when no single city has enough.
+// Requests for different items do not compete, so each item is solved on its
+// own from the donor index:
+//  - Without city_costs.txt the objective is the number of transfers. A
+//    request takes the largest remaining donors first (the fewest transfers
+//    for that request), and larger requests go first so they get the larger
+//    donors.
+//  - With city_costs.txt (lines of "cityA cityB cost", the cost per unit
+//    moved in either direction; pairs not listed cost DEFAULT_TRANSFER_COST)
+//    the objective is the total cost. A request takes the cheapest donors
+//    first, and requests go in order of regret, i.e. how much more their
+//    second-cheapest donor costs than the cheapest (Vogel's approximation).
+// A request is planned only if it can be covered in full. The plan also
+// carries a lower bound: the sum, over the planned requests, of each one's
+// best objective if it had all the stock to itself. No plan covering those
+// requests can beat it, so objective - lowerBound bounds how far the greedy
+// plan is from optimal.
+// -----------------------------------------------------------------------------
+const char CITY_COSTS_FILE[] = "city_costs.txt";
+const double DEFAULT_TRANSFER_COST = 1.0;
+
+// Cities in the cost file are numbered as they are read; each has the list of
+// (other city number, cost) pairs listed for it. Empty: count transfers.
+struct CostTable {
+    unordered_map<string, int> number;
+    vector<vector<pair<int, double>>> rows;
+};
+CostTable cityCosts;
+
+int costNumber(const string &city) {
+    auto it = cityCosts.number.find(city);
+    return (it != cityCosts.number.end()) ? it->second : -1;
+}
+
+void loadCityCosts() {
+    cityCosts = CostTable();
+    ifstream infile(CITY_COSTS_FILE);
+    string city[2];
+    double cost;
+    while (infile >> city[0] >> city[1] >> cost) {
+        int number[2];
+        for (int i = 0; i < 2; i++) {
+            auto inserted = cityCosts.number.insert({city[i], (int)cityCosts.rows.size()});
+            if (inserted.second)
+                cityCosts.rows.emplace_back();
+            number[i] = inserted.first->second;
+        }
+        cityCosts.rows[number[0]].push_back({number[1], cost});
+        cityCosts.rows[number[1]].push_back({number[0], cost});
+    }
+}
+
+struct SplitRequest {
+    string recipient;
+    string item;
+    int quantity;
+};
+
+struct SplitPlan {
+    vector<Transaction> transfers;
+    vector<size_t> unfilled;   // Requests that could not be covered in full.
+    bool byCost = false;       // The objective is total cost rather than transfers.
+    double objective = 0;
+    double lowerBound = 0;
+};
+
+// Plans the requests for one item. "requestIds" index into "requests".
+void planItemRequests(const vector<SplitRequest> &requests, const vector<size_t> &requestIds,
+                      const string &item, SplitPlan &plan) {
+    // The donors and their stock, largest first.
+    vector<string> donors;
+    vector<int> remaining;
+    ItemId id;
+    if (findItemId(item, id) && id < donorIndex.size()) {
+        for (auto h = donorIndex[id].rbegin(); h != donorIndex[id].rend() && h->first > 0; ++h) {
+            donors.push_back(h->second);
+            remaining.push_back(h->first);
+        }
+    }
+    long long totalStock = 0;
+    for (int qty : remaining)
+        totalStock += qty;
+    vector<int> donorNumbers(donors.size(), -1);
+    if (plan.byCost) {
+        for (size_t d = 0; d < donors.size(); d++)
+            donorNumbers[d] = costNumber(donors[d]);
+    }
+
+    // Each request's donors in order of preference, its best objective with
+    // all the stock to itself, and (by cost) its regret. unitCost[r][i] is the
+    // cost per unit from the i-th preferred donor.
+    size_t n = requestIds.size();
+    vector<vector<size_t>> preference(n);
+    vector<vector<double>> unitCost(n);
+    vector<double> regret(n, 0), best(n, 0);
+    vector<double> costByNumber(cityCosts.rows.size(), DEFAULT_TRANSFER_COST);
+    for (size_t r = 0; r < n; r++) {
+        const SplitRequest &request = requests[requestIds[r]];
+        vector<size_t> &order = preference[r];
+        for (size_t d = 0; d < donors.size(); d++) {
+            if (donors[d] != request.recipient)
+                order.push_back(d);
+        }
+        if (plan.byCost) {
+            int recipientNumber = costNumber(request.recipient);
+            if (recipientNumber != -1) {
+                for (auto &listed : cityCosts.rows[recipientNumber])
+                    costByNumber[listed.first] = listed.second;
+            }
+            auto costOf = [&](size_t d) {
+                return donorNumbers[d] != -1 ? costByNumber[donorNumbers[d]] : DEFAULT_TRANSFER_COST;
+            };
+            stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return costOf(a) < costOf(b); });
+            for (size_t d : order)
+                unitCost[r].push_back(costOf(d));
+            if (recipientNumber != -1) {
+                for (auto &listed : cityCosts.rows[recipientNumber])
+                    costByNumber[listed.first] = DEFAULT_TRANSFER_COST;
+            }
+            regret[r] = (order.size() > 1) ? unitCost[r][1] - unitCost[r][0] : numeric_limits<double>::max();
+        }
+        int needed = request.quantity;
+        for (size_t i = 0; i < order.size() && needed > 0; i++) {
+            int take = min(needed, remaining[order[i]]);
+            best[r] += plan.byCost ? unitCost[r][i] * take : 1;
+            needed -= take;
+        }
+    }
+
+    vector<size_t> sequence(n);
+    for (size_t r = 0; r < n; r++)
+        sequence[r] = r;
+    stable_sort(sequence.begin(), sequence.end(), [&](size_t a, size_t b) {
+        if (plan.byCost && regret[a] != regret[b])
+            return regret[a] > regret[b];
+        return requests[requestIds[a]].quantity > requests[requestIds[b]].quantity;
+    });
+
+    // Donors by remaining stock, for taking the largest first.
+    set<pair<int, size_t>> byStock;
+    for (size_t d = 0; d < donors.size(); d++)
+        byStock.insert({remaining[d], d});
+
+    for (size_t r : sequence) {
+        const SplitRequest &request = requests[requestIds[r]];
+        long long available = totalStock;
+        for (size_t d = 0; d < donors.size(); d++) {
+            if (donors[d] == request.recipient)
+                available -= remaining[d];
+        }
+        if (available < request.quantity) {
+            plan.unfilled.push_back(requestIds[r]);
+            continue;
+        }
+        plan.lowerBound += best[r];
+        int needed = request.quantity;
+        auto take = [&](size_t d, double cost) {
+            int qty = min(needed, remaining[d]);
+            if (qty == 0)
+                return;
+            byStock.erase({remaining[d], d});
+            remaining[d] -= qty;
+            byStock.insert({remaining[d], d});
+            totalStock -= qty;
+            needed -= qty;
+            plan.transfers.push_back(makeTransaction(donors[d], request.recipient, item, qty));
+            plan.objective += plan.byCost ? cost * qty : 1;
+        };
+        if (plan.byCost) {
+            for (size_t i = 0; i < preference[r].size() && needed > 0; i++)
+                take(preference[r][i], unitCost[r][i]);
+        } else {
+            // The largest donor other than the recipient; "available" ensures
+            // there is one with stock left while the request is not covered.
+            while (needed > 0) {
+                auto largest = byStock.rbegin();
+                if (donors[largest->second] == request.recipient)
+                    ++largest;
+                take(largest->second, 0);
+            }
+        }
+    }
+}
+
+SplitPlan planSplitAllocations(const vector<SplitRequest> &requests) {
+    SplitPlan plan;
+    plan.byCost = !cityCosts.rows.empty();
+    map<string, vector<size_t>> byItem;
+    for (size_t i = 0; i < requests.size(); i++)
+        byItem[requests[i].item].push_back(i);
+    for (auto &group : byItem)
+        planItemRequests(requests, group.second, group.first, plan);
+    sort(plan.unfilled.begin(), plan.unfilled.end());
+    return plan;
+}
+
+// Applies every transfer of a plan made from the current stock levels, then
+// logs the ones that were made and writes the Metro Manila file once.
+// Returns how many were made.
+size_t applySplitPlan(const SplitPlan &plan) {
+    vector<Transaction> applied;
+    for (auto &t : plan.transfers) {
+        string error = transferSupply(t.donor, t.recipient, t.item, t.quantity);
+        if (error.empty())
+            applied.push_back(t);
+        else
+            cout << "Error: " << error << "; transfer skipped.\n";
+        enforceCityMemoryBudget();
+    }
+    logTransactions(applied);
+    flushMetroManilaData(true);
+    return applied.size();
+}
+
+void printSplitPlan(const SplitPlan &plan) {
+    for (auto &t : plan.transfers) {
+        cout << "  " << t.quantity << " of \"" << t.item << "\" from \"" << t.donor << "\" to \""
+             << t.recipient << "\"\n";
+    }
+    cout << plan.transfers.size() << " transfer(s)";
+    if (plan.byCost)
+        cout << ", total cost " << plan.objective << " (lower bound " << plan.lowerBound << ")";
+    else
+        cout << " (lower bound " << plan.lowerBound << ")";
+    cout << ".\n";
+}
+
+// -----------------------------------------------------------------------------
+// Option: Allocate resources from one city to another.
+// -----------------------------------------------------------------------------
+void allocateResource() {
+    cout << "\nEnter your city (recipient): ";
+    string recipientCity;
+    getline(cin, recipientCity);
+    if (!isRegistered(recipientCity)) {
+        cout << "Error: City \"" << recipientCity << "\" is not registered in the system.\n";
+        return;
+    }
+    cout << "Enter the item you need: ";
+    string itemNeeded;
+    getline(cin, itemNeeded);
+    cout << "Enter the quantity needed: ";
+    int qtyNeeded;
+    cin >> qtyNeeded;
+    cin.ignore(); // Remove newline
+
+    vector<pair<string, int>> donors = findDonors(itemNeeded, qtyNeeded, recipientCity);
+    if (donors.empty() && qtyNeeded > 0) {
+        // No single city has enough; offer to split the request.
+        loadCityCosts();
+        SplitPlan plan = planSplitAllocations({{recipientCity, itemNeeded, qtyNeeded}});
+        if (plan.transfers.empty()) {
+            cout << "Not enough \"" << itemNeeded << "\" is available in Metro Manila.\n";
+            return;
+        }
+        cout << "\nNo single donor city has enough \"" << itemNeeded << "\". It can be split as:\n";
+        printSplitPlan(plan);
+        cout << "Allocate from these donors? (y/n): ";
+        string answer;
+        getline(cin, answer);
+        if (answer != "y" && answer != "Y") {
+            cout << "Allocation cancelled.\n";
+            return;
+        }
+        size_t applied = applySplitPlan(plan);
+        if (applied < plan.transfers.size()) {
+            cout << "Allocation incomplete: " << applied << " of " << plan.transfers.size()
+                 << " transfer(s) applied.\n";
+            return;
+        }
+        cout << "Allocation successful! " << qtyNeeded << " of \"" << itemNeeded << "\" allocated to \""
+             << recipientCity << "\" from " << plan.transfers.size() << " donor cities.\n";
+        return;
+    }
+    if (donors.empty()) {
+        cout << "No donor city has enough \"" << itemNeeded << "\" available.\n";
+        return;
+    }
+    cout << "\nDonor cities with available \"" << itemNeeded << "\":\n";
+    for (auto &donor : donors) {
+        cout << "  " << donor.first << " - Available: " << donor.second << "\n";
+    }
+    cout << "Enter the donor city you want to allocate from: ";
+    string donorCity;
+    getline(cin, donorCity);
+    bool valid = false;
+    for (auto &d : donors) {
+        if (d.first == donorCity) { valid = true; break; }
+    }
+    if (!valid) {
+        cout << "Invalid donor city selection.\n";
+        return;
+    }
+    string error = transferSupply(donorCity, recipientCity, itemNeeded, qtyNeeded);
+    if (!error.empty()) {
+        cout << "Error: " << error << ".\n";
+        return;
+    }
+    flushMetroManilaData(false);
+    // Log the transaction; it is in the journal before success is reported.
+    logTransaction(donorCity, recipientCity, itemNeeded, qtyNeeded);
+    cout << "Allocation successful! " << qtyNeeded << " of \"" << itemNeeded << "\" allocated from \""
+         << donorCity << "\" to \"" << recipientCity << "\".\n";
+}
+
+// Reads a request's quantity. Returns an error message, or "" on success.
+string parseQuantity(const string &qtyText, int &quantity) {
+    if (qtyText.size() > 9 || qtyText.find_first_not_of("0123456789") != string::npos)
+        return "invalid quantity \"" + qtyText + "\"";
+    quantity = stoi(qtyText);
+    if (quantity <= 0)
+        return "quantity must be positive";
+    return "";
+}
+
+// -----------------------------------------------------------------------------
+// Parses an allocation request ("recipient item qty [donor]") into "t" and
+// checks the parts that do not depend on stock levels. Returns an error
+// message, or "" if the request is well formed. t.donor is left empty when no
+// donor is given.
+// -----------------------------------------------------------------------------
+string parseAllocationRequest(const string &line, Transaction &t) {
+    istringstream iss(line);
+    string qtyText, extra;
+    t.donor.clear();
+    if (!(iss >> t.recipient >> t.item >> qtyText))
+        return "expected \"recipient item qty [donor]\"";
+    iss >> t.donor;
+    if (iss >> extra)
+        return "unexpected text \"" + extra + "\"";
+    string error = parseQuantity(qtyText, t.quantity);
+    if (!error.empty())
+        return error;
+    if (!isRegistered(t.recipient))
+        return "city \"" + t.recipient + "\" is not registered";
+    if (!t.donor.empty() && t.donor == t.recipient)
+        return "donor and recipient are the same city";
+    if (!t.donor.empty() && !isRegistered(t.donor))
+        return "city \"" + t.donor + "\" is not registered";
+    return "";
+}
+
+// -----------------------------------------------------------------------------
+// Validates one batch line ("recipient item qty [donor]") and, if it is valid,
+// applies it and fills in "t". Returns an error message, or "" on success.
+// Without a donor, the city holding the most of the item is used.
+// -----------------------------------------------------------------------------
+string applyBatchLine(const string &line, Transaction &t) {
+    string error = parseAllocationRequest(line, t);
+    if (!error.empty())
+        return error;
+    if (t.donor.empty()) {
+        vector<pair<string, int>> donors = findDonors(t.item, t.quantity, t.recipient);
+        if (donors.empty())
+            return "no donor city has enough \"" + t.item + "\"";
+        t.donor = donors.front().first;
+    } else {
+        ItemId item;
+        int available = 0;
+        if (!findItemId(t.item, item) || !cityQuantity(t.donor, item, available) || available < t.quantity)
+            return "donor city \"" + t.donor + "\" does not have enough \"" + t.item + "\"";
+    }
+    return transferSupply(t.donor, t.recipient, t.item, t.quantity);
+}
+
+// -----------------------------------------------------------------------------
+// Batch allocation: applies every line of "in" against the in-memory data and
+// reports a result per line. Blank lines and lines starting with '#' are
+// skipped. The Metro Manila file and the transaction log are written once for
+// the whole batch rather than once per request.
+// -----------------------------------------------------------------------------
+void processAllocationBatch(istream &in) {
+    vector<Transaction> applied;
+    int lineNo = 0, failed = 0;
+    string line;
+    ostringstream report;  // Printed once the allocations are journaled.
+    while (getline(in, line)) {
+        lineNo++;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#')
+            continue;
+        Transaction t;
+        string error = applyBatchLine(line, t);
+        enforceCityMemoryBudget();
+        if (error.empty()) {
+            applied.push_back(t);
+            report << "Line " << lineNo << ": allocated " << t.quantity << " of \"" << t.item
+                   << "\" from \"" << t.donor << "\" to \"" << t.recipient << "\".\n";
+        } else {
+            failed++;
+            report << "Line " << lineNo << ": error: " << error << ".\n";
+        }
+    }
+    logTransactions(applied);
+    flushMetroManilaData(true);
+    cout << report.str();
+    cout << "Batch complete: " << applied.size() << " allocated, " << failed << " failed.\n";
+}
+
+// -----------------------------------------------------------------------------
+// Option: Run a batch allocation file.
+// -----------------------------------------------------------------------------
+void runBatchFile(const string &filename) {
+    ifstream infile(filename);
+    if (!infile) {
+        cout << "Error: File \"" << filename << "\" not found!\n";
+        return;
+    }
+    processAllocationBatch(infile);
+}
+
+void allocateFromBatchFile() {
+    cout << "\nEnter batch file name (lines of \"recipient item qty [donor]\"): ";
+    string filename;
+    getline(cin, filename);
+    runBatchFile(filename);
+}
+
+// -----------------------------------------------------------------------------
+// Split batch allocation: reads "recipient item qty" lines from "in", plans
+// them together with the split solver and applies the plan (after asking, if
+// "confirm" is set). Requests that cannot be covered in full are reported and
+// left out.
+// -----------------------------------------------------------------------------
+void processSplitBatch(istream &in, bool confirm) {
+    vector<SplitRequest> requests;
+    vector<int> requestLines;
+    int lineNo = 0;
+    string line;
+    while (getline(in, line)) {
+        lineNo++;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#')
+            continue;
+        Transaction t;
+        string error = parseAllocationRequest(line, t);
+        if (error.empty() && !t.donor.empty())
+            error = "split batches choose their own donors";
+        if (!error.empty()) {
+            cout << "Line " << lineNo << ": error: " << error << ".\n";
+            continue;
+        }
+        requests.push_back({t.recipient, t.item, t.quantity});
+        requestLines.push_back(lineNo);
+    }
+
+    loadCityCosts();
+    auto started = chrono::steady_clock::now();
+    SplitPlan plan = planSplitAllocations(requests);
+    double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    for (size_t i : plan.unfilled) {
+        cout << "Line " << requestLines[i] << ": error: not enough \"" << requests[i].item
+             << "\" available to cover the request.\n";
+    }
+    cout << "\nPlan for " << requests.size() - plan.unfilled.size() << " of " << requests.size()
+         << " request(s), solved in " << fixed << setprecision(1) << elapsed << " ms:\n";
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+    printSplitPlan(plan);
+    if (plan.transfers.empty())
+        return;
+    if (confirm) {
+        cout << "Apply this plan? (y/n): ";
+        string answer;
+        getline(cin, answer);
+        if (answer != "y" && answer != "Y") {
+            cout << "Plan discarded.\n";
+            return;
+        }
+    }
+    cout << "Split batch complete: " << applySplitPlan(plan) << " transfer(s) applied.\n";
+}
+
+void allocateFromSplitBatchFile() {
+    cout << "\nEnter batch file name (lines of \"recipient item qty\"): ";
+    string filename;
+    getline(cin, filename);
+    ifstream infile(filename);
+    if (!infile) {
+        cout << "Error: File \"" << filename << "\" not found!\n";
+        return;
+    }
+    processSplitBatch(infile, true);
+}
+
+// -----------------------------------------------------------------------------
+// Rebalancing planner. Brings every city's stock of each item toward a
+// target: the metro mean, or a share of the metro total in proportion to the
+// city's weight in city_demand.txt ("city weight" lines; cities not listed
+// are left out). Targets are whole units adding up to the total: each city
+// gets the integer part of its share, and the units left over go to the
+// largest fractional parts (ties to the cities already holding more, which
+// then move less). Cities within "tolerance" percent of their target are left
+// alone.
+// Each item is planned on its own for few transfers: a surplus and a deficit
+// of the same size are paired first, then the largest surplus repeatedly
+// fills the largest deficit, so every transfer settles at least one city.
+// Whatever is left of the larger one is paired at once if it exactly matches
+// a city on the other side, settling two cities with the next transfer.
+// Every city out of balance (on the side with the smaller total, if the
+// tolerance leaves the sides unequal) needs a transfer of its own, which is
+// the lower bound. Items are independent, so they are planned on a pool of
+// worker threads that only read the donor index, and the combined plan is
+// applied as one batch.
+// -----------------------------------------------------------------------------
+const char CITY_DEMAND_FILE[] = "city_demand.txt";
+const int DEFAULT_REBALANCE_TOLERANCE = 10;
+const size_t REBALANCE_ITEMS_SHOWN = 25;
+
+struct RebalanceTargets {
+    vector<string> cities;
+    unordered_map<string, size_t> index;  // City -> position in "cities".
+    vector<double> weights;               // 0: the city is left out.
+    double weightTotal = 0;
+    int tolerance = DEFAULT_REBALANCE_TOLERANCE;
+};
+
+struct RebalanceItem {
+    ItemId item = 0;
+    vector<Transaction> transfers;
+    long long moved = 0;
+    int worstBefore = 0;  // Largest distance of a city from its target.
+    int worstAfter = 0;
+    size_t lowerBound = 0;
+};
+
+// Every registered city with weight 1, or with its weight from
+// CITY_DEMAND_FILE.
+RebalanceTargets rebalanceTargets(bool byDemand, int tolerance) {
+    RebalanceTargets targets;
+    targets.tolerance = tolerance;
+    map<string, double> listed;
+    if (byDemand) {
+        ifstream infile(CITY_DEMAND_FILE);
+        string city;
+        double weight;
+        while (infile >> city >> weight) {
+            if (weight > 0)
+                listed[city] = weight;
+        }
+    }
+    for (auto &entry : cityRegistry) {
+        targets.index[entry.first] = targets.cities.size();
+        targets.cities.push_back(entry.first);
+        double weight = 1;
+        if (byDemand) {
+            auto it = listed.find(entry.first);
+            weight = (it != listed.end()) ? it->second : 0;
+        }
+        targets.weights.push_back(weight);
+        targets.weightTotal += weight;
+    }
+    return targets;
+}
+
+void planRebalanceItem(const RebalanceTargets &targets, ItemId item, RebalanceItem &plan) {
+    plan.item = item;
+    size_t n = targets.cities.size();
+    vector<int> qty(n, 0);
+    for (auto &holder : donorIndex[item])
+        qty[targets.index.find(holder.second)->second] = holder.first;
+    vector<size_t> taking;
+    long long total = 0;
+    for (size_t c = 0; c < n; c++) {
+        if (targets.weights[c] > 0) {
+            taking.push_back(c);
+            total += qty[c];
+        }
+    }
+    if (total == 0)
+        return;
+
+    vector<int> target(n, 0);
+    vector<double> fraction(n, 0);
+    long long assigned = 0;
+    for (size_t c : taking) {
+        double share = total * targets.weights[c] / targets.weightTotal;
+        target[c] = (int)floor(share);
+        fraction[c] = share - target[c];
+        assigned += target[c];
+    }
+    vector<size_t> order = taking;
+    sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return (fraction[a] != fraction[b]) ? fraction[a] > fraction[b] : qty[a] > qty[b];
+    });
+    for (size_t i = 0; i < order.size() && assigned < total; i++, assigned++)
+        target[order[i]]++;
+
+    // (units, city) for the cities above and below their targets.
+    vector<pair<int, size_t>> surplus, deficit;
+    long long give = 0, need = 0;
+    for (size_t c : taking) {
+        int gap = qty[c] - target[c];
+        int slack = (int)((long long)target[c] * targets.tolerance / 100);
+        plan.worstBefore = max(plan.worstBefore, abs(gap));
+        if (gap > slack) {
+            surplus.push_back({gap, c});
+            give += gap;
+        } else if (-gap > slack) {
+            deficit.push_back({-gap, c});
+            need += -gap;
+        }
+    }
+    if (give == need)
+        plan.lowerBound = max(surplus.size(), deficit.size());
+    else
+        plan.lowerBound = (give < need) ? surplus.size() : deficit.size();
+
+    plan.transfers.reserve(surplus.size() + deficit.size());
+    auto transfer = [&](size_t from, size_t to, int units) {
+        plan.transfers.push_back(makeTransaction(targets.cities[from], targets.cities[to], itemName(item), units));
+        qty[from] -= units;
+        qty[to] += units;
+        plan.moved += units;
+    };
+    set<pair<int, size_t>> gives, needs(deficit.begin(), deficit.end());
+    // Settles "left" units of city "c" against an exact partner on the other
+    // side if there is one, and otherwise keeps them on its own side.
+    auto settle = [&](set<pair<int, size_t>> &own, set<pair<int, size_t>> &other, int left, size_t c, bool giving) {
+        auto exact = other.lower_bound({left, 0});
+        if (exact != other.end() && exact->first == left) {
+            transfer(giving ? c : exact->second, giving ? exact->second : c, left);
+            other.erase(exact);
+        } else {
+            own.insert({left, c});
+        }
+    };
+    for (auto &s : surplus)
+        settle(gives, needs, s.first, s.second, true);
+    while (!gives.empty() && !needs.empty()) {
+        pair<int, size_t> from = *gives.rbegin(), to = *needs.rbegin();
+        gives.erase(from);
+        needs.erase(to);
+        int units = min(from.first, to.first);
+        transfer(from.second, to.second, units);
+        if (from.first > units)
+            settle(gives, needs, from.first - units, from.second, true);
+        if (to.first > units)
+            settle(needs, gives, to.first - units, to.second, false);
+    }
+    for (size_t c : taking)
+        plan.worstAfter = max(plan.worstAfter, abs(qty[c] - target[c]));
+}
+
+// Plans "items" (every item, if empty) across the worker threads. Returns the
+// items that need transfers, in name order.
+vector<RebalanceItem> planRebalance(const RebalanceTargets &targets, vector<ItemId> items) {
+    if (items.empty()) {
+        for (ItemId item = 0; item < donorIndex.size(); item++) {
+            if (!donorIndex[item].empty())
+                items.push_back(item);
+        }
+    }
+    vector<RebalanceItem> plans(items.size());
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < items.size(); i = next++)
+            planRebalanceItem(targets, items[i], plans[i]);
+    };
+    size_t threadCount = min<size_t>(max(1u, thread::hardware_concurrency()), items.size());
+    vector<thread> pool;
+    for (size_t t = 1; t < threadCount; t++)
+        pool.emplace_back(worker);
+    worker();  // The calling thread works too.
+    for (auto &t : pool)
+        t.join();
+
+    plans.erase(remove_if(plans.begin(), plans.end(), [](const RebalanceItem &p) { return p.transfers.empty(); }),
+                plans.end());
+    sort(plans.begin(), plans.end(),
+         [](const RebalanceItem &a, const RebalanceItem &b) { return itemName(a.item) < itemName(b.item); });
+    return plans;
+}
+
+// Plans a rebalancing of "item" (every item, if empty), shows a summary and
+// applies it as one batch (after asking, if "confirm" is set).
+void processRebalance(bool byDemand, int tolerance, const string &item, bool confirm) {
+    RebalanceTargets targets = rebalanceTargets(byDemand, tolerance);
+    if (targets.weightTotal <= 0) {
+        cout << "Error: no registered city has a weight in \"" << CITY_DEMAND_FILE << "\".\n";
+        return;
+    }
+    vector<ItemId> items;
+    if (!item.empty()) {
+        ItemId id;
+        if (!findItemId(item, id) || id >= donorIndex.size() || donorIndex[id].empty()) {
+            cout << "Error: no city holds \"" << item << "\".\n";
+            return;
+        }
+        items.push_back(id);
+    }
+    auto started = chrono::steady_clock::now();
+    vector<RebalanceItem> plans = planRebalance(targets, items);
+    double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    SplitPlan plan;
+    long long moved = 0;
+    size_t lowerBound = 0;
+    for (auto &p : plans) {
+        plan.transfers.insert(plan.transfers.end(), p.transfers.begin(), p.transfers.end());
+        moved += p.moved;
+        lowerBound += p.lowerBound;
+    }
+    plan.objective = plan.transfers.size();
+    plan.lowerBound = lowerBound;
+    cout << "\nRebalancing toward " << (byDemand ? "the demand-weighted share" : "the metro mean")
+         << ", planned in " << fixed << setprecision(1) << elapsed << " ms:\n";
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+    if (plans.empty()) {
+        cout << "Every city is within " << tolerance << "% of its target; nothing to move.\n";
+        return;
+    }
+    for (size_t i = 0; i < plans.size() && i < REBALANCE_ITEMS_SHOWN; i++) {
+        const RebalanceItem &p = plans[i];
+        cout << "  " << itemName(p.item) << " : " << p.transfers.size() << " transfer(s) moving " << p.moved
+             << ", largest gap from a target " << p.worstBefore << " -> " << p.worstAfter << "\n";
+    }
+    if (plans.size() > REBALANCE_ITEMS_SHOWN)
+        cout << "  ... and " << plans.size() - REBALANCE_ITEMS_SHOWN << " more item(s).\n";
+    cout << plans.size() << " item(s), " << plan.transfers.size() << " transfer(s) moving " << moved
+         << " unit(s) (lower bound " << lowerBound << " transfers).\n";
+    while (confirm) {
+        cout << "Apply this plan? (y/n, or l to list the transfers): ";
+        string answer;
+        getline(cin, answer);
+        if (answer == "l" || answer == "L") {
+            printSplitPlan(plan);
+            continue;
+        }
+        if (answer != "y" && answer != "Y") {
+            cout << "Plan discarded.\n";
+            return;
+        }
+        break;
+    }
+    cout << "Rebalancing complete: " << applySplitPlan(plan) << " transfer(s) applied.\n";
+}
+
+// -----------------------------------------------------------------------------
+// Option: Rebalance stock across the cities.
+// -----------------------------------------------------------------------------
+void rebalanceInventory() {
+    cout << "\nRebalance toward: 1. the metro mean  2. a demand-weighted share (" << CITY_DEMAND_FILE << "): ";
+    string line;
+    getline(cin, line);
+    bool byDemand = (line == "2");
+    cout << "Item to rebalance (leave blank for every item): ";
+    string item;
+    getline(cin, item);
+    cout << "Leave cities within this many percent of their target alone (default "
+         << DEFAULT_REBALANCE_TOLERANCE << "): ";
+    getline(cin, line);
+    int tolerance = line.empty() ? DEFAULT_REBALANCE_TOLERANCE : max(0, atoi(line.c_str()));
+    processRebalance(byDemand, tolerance, item, true);
+}
+
+// -----------------------------------------------------------------------------
+// Allocation service ("--serve <socket>"). Several dispatch consoles connect
+// to a Unix domain socket and send one request per line; every connection is
+// served by its own thread:
+//   ALLOCATE recipient item qty [donor]  ->  OK donor qty    | ERR message
+//   QUERY city item                      ->  OK qty          | ERR message
+//   METRO item                           ->  OK total        | ERR message
+//   DONORS item k                        ->  OK city:qty ... (largest first)
+//   SHORTAGES k                          ->  OK city:item:shortfall ... (worst first)
+//   QUIT                                    closes the connection
+//   SHUTDOWN                             ->  OK, then the service saves and exits
+// A service running as a shard (see "--shards" below) also takes the two
+// halves of an allocation whose other city is on another shard, each tagged
+// with the coordinator's id for the transfer:
+//   DEBIT id donor recipient item qty    ->  OK | ERR message  (takes from donor)
+//   CREDIT id donor recipient item qty   ->  OK | ERR message  (gives to recipient)
+//   CANCEL id donor                      ->  OK | ERR message  (gives a debit back)
+//   TRANSFER id city                     ->  OK phase ...  (DEBIT, CREDIT, CANCEL)
+//
+// Locking: each city has its own mutex. An allocation locks its donor and
+// recipient in name order, so two allocations can never wait on each other in
+// a cycle, and the debit and credit happen together. The shared per-item
+// structures (the donor index entry and the Metro Manila total) are guarded by
+// one of ITEM_LOCK_STRIPES mutexes picked by item id, always taken after the
+// city locks; the journal has its own lock, taken last, while the cities are
+// still locked (see journalServiceTransaction). A request is answered only
+// once its journal record is in the file; requests journaling at the same
+// time share one group commit. Allocations between
+// different cities of different items therefore run in parallel. A credit of
+// an item the process has never seen grows the per-item structures (and the
+// dense matrix), so it takes every city lock and then every item lock.
+//
+// QUERY takes none of these locks: after every change a city publishes an
+// immutable copy of its records through an atomic shared_ptr, and QUERY reads
+// the latest copy. METRO reads the live total under its item's lock, since a
+// DEBIT or CREDIT changes it. Every city is loaded for the whole service and
+// the memory budget is not enforced.
+// -----------------------------------------------------------------------------
+const int ITEM_LOCK_STRIPES = 64;
+const int SERVICE_RETRIES = 8;  // Donor choices to try when other consoles win the race.
+const int SERVICE_MAINTENANCE_SECONDS = 1;
+
+struct ServiceCity {
+    mutex lock;                                  // Guards the city's records.
+    shared_ptr<const vector<Supply>> published;  // Latest copy for readers.
+};
+
+map<string, ServiceCity> serviceCities;  // Built before the workers start; never resized.
+mutex itemLocks[ITEM_LOCK_STRIPES];
+atomic<bool> serviceStopping(false);
+atomic<int> serviceListenFd(-1);
+
+mutex &itemLock(ItemId item) {
+    return itemLocks[item % ITEM_LOCK_STRIPES];
+}
+
+// Takes every city lock and then every item lock, in the usual order, which
+// waits for every allocation in progress and holds off the rest.
+vector<unique_lock<mutex>> lockAllServiceState() {
+    vector<unique_lock<mutex>> all;
+    for (auto &entry : serviceCities)
+        all.emplace_back(entry.second.lock);
+    for (auto &stripe : itemLocks)
+        all.emplace_back(stripe);
+    return all;
+}
+
+// Publishes a copy of a city's records. The caller holds the city's lock.
+void publishCity(const string &city) {
+    auto copy = make_shared<const vector<Supply>>(citySupplies(city));
+    atomic_store(&serviceCities.find(city)->second.published, copy);
+}
+
+// Journals a transaction the service has applied and returns once it is
+// committed. The caller still holds the locks of the cities it changed, so a
+// checkpoint, taken with every lock held, never sees a change whose record
+// is not in the journal yet.
+void journalServiceTransaction(const Transaction &t) {
+    logTransactions({t});
+}
+
+// The locked counterpart of applyBatchLine.
+string serviceAllocate(const string &request, Transaction &t) {
+    string error = parseAllocationRequest(request, t);
+    if (!error.empty())
+        return error;
+    string notEnough = t.donor.empty() ? "no donor city has enough \"" + t.item + "\""
+                                       : "donor city \"" + t.donor + "\" does not have enough \"" + t.item + "\"";
+    ItemId item;
+    if (!findItemId(t.item, item))
+        return notEnough;
+    for (int attempt = 0; attempt < SERVICE_RETRIES; attempt++) {
+        string donor = t.donor;
+        if (donor.empty()) {
+            lock_guard<mutex> guard(itemLock(item));
+            vector<pair<string, int>> donors = findDonors(t.item, t.quantity, t.recipient);
+            if (donors.empty())
+                return notEnough;
+            donor = donors.front().first;
+        }
+        ServiceCity &first = serviceCities.find(min(donor, t.recipient))->second;
+        ServiceCity &second = serviceCities.find(max(donor, t.recipient))->second;
+        lock_guard<mutex> firstGuard(first.lock);
+        lock_guard<mutex> secondGuard(second.lock);
+        int available = 0;
+        if (!cityQuantity(donor, item, available) || available < t.quantity) {
+            if (!t.donor.empty())
+                return notEnough;
+            continue;  // Another console took the stock since the donor was chosen.
+        }
+        {
+            lock_guard<mutex> guard(itemLock(item));
+            string error = transferSupply(donor, t.recipient, t.item, t.quantity);
+            if (!error.empty())
+                return error;
+        }
+        publishCity(donor);
+        publishCity(t.recipient);
+        t.donor = donor;
+        journalServiceTransaction(t);
+        return "";
+    }
+    return notEnough;
+}
+
+// Applies one half of an allocation between shards: the debit from a donor
+// on this process, or the credit to a recipient on this process. The request
+// is checked as parseAllocationRequest checks an allocation, except that the
+// other city is registered on another shard; it is only recorded. The journal
+// record carries the transfer id, so CANCEL and TRANSFER can find it.
+string serviceTransferHalf(const string &request, bool debit, Transaction &t) {
+    istringstream iss(request);
+    string qtyText, extra;
+    if (!(iss >> t.transfer >> t.donor >> t.recipient >> t.item >> qtyText))
+        return "expected \"id donor recipient item qty\"";
+    if (iss >> extra)
+        return "unexpected text \"" + extra + "\"";
+    string error = parseQuantity(qtyText, t.quantity);
+    if (!error.empty())
+        return error;
+    if (t.donor == t.recipient)
+        return "donor and recipient are the same city";
+    const string &city = debit ? t.donor : t.recipient;
+    auto entry = serviceCities.find(city);
+    if (entry == serviceCities.end())
+        return "city \"" + city + "\" is not registered";
+    if (serviceCities.count(debit ? t.recipient : t.donor))
+        return "city \"" + (debit ? t.recipient : t.donor) + "\" is on this shard; use ALLOCATE";
+    string notEnough = "donor city \"" + t.donor + "\" does not have enough \"" + t.item + "\"";
+    ItemId item;
+    bool known = findItemId(t.item, item);
+    if (debit && !known)
+        return notEnough;
+    if (known) {
+        lock_guard<mutex> cityGuard(entry->second.lock);
+        lock_guard<mutex> itemGuard(itemLock(item));
+        int held = 0;
+        bool holds = cityQuantity(city, item, held);
+        if (debit && (!holds || held < t.quantity))
+            return notEnough;
+        // Some city here holds the item, so it has its donor index entry, its
+        // Metro Manila record and (in dense mode) its column.
+        if (item < donorIndex.size() && !donorIndex[item].empty() && (!dense.enabled || item < dense.stride)) {
+            setCityQuantity(city, item, debit ? held - t.quantity : held + t.quantity);
+            publishCity(city);
+            journalServiceTransaction(t);
+            return "";
+        }
+    }
+    // The item is new to this process: stop everything else while it is added.
+    vector<unique_lock<mutex>> all = lockAllServiceState();
+    item = internItem(t.item);
+    int held = 0;
+    cityQuantity(city, item, held);
+    setCityQuantity(city, item, held + t.quantity);
+    publishCity(city);
+    journalServiceTransaction(t);
+    return "";
+}
+
+// The journal records of transfer "id" that involve "city", oldest first.
+// The caller holds every service lock, so no thread is journaling.
+vector<Transaction> transferRecords(const string &id, const string &city) {
+    HistoryQuery q;
+    q.city = city;
+    vector<Transaction> records;
+    for (auto &t : queryHistory(q)) {
+        if (t.transfer == id)
+            records.push_back(t);
+    }
+    return records;
+}
+
+// Gives back the debit of transfer "id" from "donor", whose credit did not
+// happen. Journals it as a cancellation of the debit (its quantity negated),
+// so the history never shows a transfer back. Does nothing if the debit was
+// never made or is already cancelled, so the coordinator can repeat it.
+string serviceCancelTransfer(const string &id, const string &donor) {
+    if (id.empty() || !serviceCities.count(donor))
+        return "city \"" + donor + "\" is not registered";
+    vector<unique_lock<mutex>> all = lockAllServiceState();
+    Transaction debit;
+    bool debited = false, cancelled = false;
+    for (auto &t : transferRecords(id, donor)) {
+        if (t.quantity < 0) {
+            cancelled = true;
+        } else if (t.donor == donor) {
+            debit = t;
+            debited = true;
+        }
+    }
+    if (!debited || cancelled)
+        return "";
+    ItemId item = internItem(debit.item);
+    int held = 0;
+    cityQuantity(donor, item, held);
+    setCityQuantity(donor, item, held + debit.quantity);
+    publishCity(donor);
+    debit.quantity = -debit.quantity;
+    journalServiceTransaction(debit);
+    return "";
+}
+
+// Handles one request line. Returns the reply, or "" to close the connection.
+string handleServiceRequest(const string &line) {
+    istringstream iss(line);
+    string command, rest;
+    iss >> command;
+    getline(iss, rest);
+    if (command == "ALLOCATE") {
+        Transaction t;
+        string error = serviceAllocate(rest, t);
+        if (!error.empty())
+            return "ERR " + error;
+        return "OK " + t.donor + " " + to_string(t.quantity);
+    }
+    if (command == "QUERY") {
+        istringstream args(rest);
+        string city, item;
+        args >> city >> item;
+        auto it = serviceCities.find(city);
+        if (it == serviceCities.end())
+            return "ERR city \"" + city + "\" is not registered";
+        shared_ptr<const vector<Supply>> records = atomic_load(&it->second.published);
+        int index = binarySearch(*records, item);
+        if (index == -1)
+            return "ERR item \"" + item + "\" not found in \"" + city + "\"";
+        return "OK " + to_string((*records)[index].quantity);
+    }
+    if (command == "METRO") {
+        string item;
+        istringstream(rest) >> item;
+        ItemId id;
+        if (findItemId(item, id)) {
+            lock_guard<mutex> guard(itemLock(id));
+            int index = binarySearch(metroManilaData, item);
+            if (index != -1)
+                return "OK " + to_string(metroManilaData[index].quantity);
+        }
+        return "ERR item \"" + item + "\" not found in the Metro Manila dataset";
+    }
+    if (command == "DONORS") {
+        string item;
+        int k = 0;
+        istringstream(rest) >> item >> k;
+        ItemId id;
+        string reply = "OK";
+        if (findItemId(item, id)) {
+            lock_guard<mutex> guard(itemLock(id));
+            for (auto &donor : topDonors(item, k))
+                reply += " " + donor.first + ":" + to_string(donor.second);
+        }
+        return reply;
+    }
+    if (command == "SHORTAGES") {
+        int k = 0;
+        istringstream(rest) >> k;
+        string reply = "OK";
+        vector<Shortage> worst = worstShortages(max(k, 0));
+        lock_guard<mutex> guard(itemDictionary.lock);  // A CREDIT may be adding a name.
+        for (auto &s : worst)
+            reply += " " + s.city + ":" + itemName(s.item) + ":" + to_string(s.shortfall);
+        return reply;
+    }
+    if (command == "DEBIT" || command == "CREDIT") {
+        Transaction t;
+        string error = serviceTransferHalf(rest, command == "DEBIT", t);
+        if (!error.empty())
+            return "ERR " + error;
+        return "OK";
+    }
+    if (command == "CANCEL") {
+        string id, donor;
+        istringstream(rest) >> id >> donor;
+        string error = serviceCancelTransfer(id, donor);
+        if (!error.empty())
+            return "ERR " + error;
+        return "OK";
+    }
+    if (command == "TRANSFER") {
+        string id, city;
+        istringstream(rest) >> id >> city;
+        if (!serviceCities.count(city))
+            return "ERR city \"" + city + "\" is not registered";
+        vector<unique_lock<mutex>> all = lockAllServiceState();
+        string reply = "OK";
+        for (auto &t : transferRecords(id, city))
+            reply += t.quantity < 0 ? " CANCEL" : t.donor == city ? " DEBIT" : " CREDIT";
+        return reply;
+    }
+    if (command == "QUIT")
+        return "";
+    if (command == "SHUTDOWN") {
+        serviceStopping = true;  // The accept loop is woken once "OK" is sent.
+        return "OK";
+    }
+    return "ERR unknown command \"" + command + "\"";
+}
+
+#ifndef _WIN32
+bool writeAll(int fd, const string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        long written = write(fd, data.data() + done, data.size() - done);
+        if (written <= 0)
+            return false;
+        done += written;
+    }
+    return true;
+}
+
+// Reads the next line from "fd" into "line" (without its line ending).
+// "pending" holds what was read past the previous line. Returns false when
+// the connection closes.
+bool readLine(int fd, string &pending, string &line) {
+    char buf[4096];
+    size_t newline;
+    while ((newline = pending.find('\n')) == string::npos) {
+        long n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+            return false;
+        pending.append(buf, n);
+    }
+    line = pending.substr(0, newline);
+    pending.erase(0, newline + 1);
+    if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+    return true;
+}
+
+// Wakes the accept loop so it sees serviceStopping. Only async-signal-safe
+// calls, as it also runs in the signal handler.
+void wakeAcceptLoop() {
+    int listenFd = serviceListenFd;
+    if (listenFd != -1)
+        shutdown(listenFd, SHUT_RDWR);
+}
+
+// SIGTERM and SIGINT (Ctrl+C) stop the service as SHUTDOWN does, so the
+// journal is committed and the inventory saved on the way out.
+void stopServiceOnSignal(int) {
+    serviceStopping = true;
+    wakeAcceptLoop();
+}
+
+// Answers every request on a connection with "handle" until it closes or
+// "handle" returns "". After SHUTDOWN the accept loop is only woken once the
+// reply has been written, since waking it disconnects every console.
+void serveConnection(int fd, const function<string(const string &)> &handle) {
+    string pending, line;
+    while (readLine(fd, pending, line)) {
+        if (line.find_first_not_of(" \t") == string::npos)
+            continue;
+        string reply = handle(line);
+        bool written = !reply.empty() && writeAll(fd, reply + "\n");
+        if (serviceStopping) {
+            wakeAcceptLoop();
+            return;
+        }
+        if (!written)
+            return;
+    }
+}
+
+// Binds and listens on a Unix domain socket, and makes it the one the accept
+// loop and the stop signals use. Returns the socket, or -1.
+int listenOnSocket(const string &socketPath) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        cout << "Error: socket path \"" << socketPath << "\" is too long.\n";
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listenFd == -1 || bind(listenFd, (sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listenFd, SOMAXCONN) != 0) {
+        cout << "Error: could not listen on \"" << socketPath << "\".\n";
+        if (listenFd != -1)
+            close(listenFd);
+        return -1;
+    }
+    serviceStopping = false;
+    serviceListenFd = listenFd;
+    signal(SIGPIPE, SIG_IGN);  // A console that disconnects early must not end the service.
+    signal(SIGTERM, stopServiceOnSignal);
+    signal(SIGINT, stopServiceOnSignal);
+    return listenFd;
+}
+
+// Serves every connection on its own thread with "serve" until SHUTDOWN sets
+// serviceStopping, then disconnects the remaining clients and waits for them.
+// A worker whose console has gone is joined at the next accept, so a
+// long-running service only keeps the threads of connections still open.
+void acceptConnections(int listenFd, const function<void(int)> &serve) {
+    mutex clientsLock;
+    set<int> clients;
+    map<unsigned long, thread> workers;  // By connection number.
+    vector<unsigned long> finished;      // Workers that have returned; guarded by clientsLock.
+    unsigned long connections = 0;
+    auto joinFinished = [&]() {
+        vector<unsigned long> done;
+        {
+            lock_guard<mutex> guard(clientsLock);
+            done.swap(finished);
+        }
+        for (unsigned long id : done) {
+            workers[id].join();
+            workers.erase(id);
+        }
+    };
+    while (!serviceStopping) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        joinFinished();
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        lock_guard<mutex> guard(clientsLock);
+        clients.insert(fd);
+        unsigned long id = connections++;
+        workers[id] = thread([fd, id, &serve, &clients, &finished, &clientsLock]() {
+            serve(fd);
+            lock_guard<mutex> guard(clientsLock);
+            clients.erase(fd);
+            close(fd);
+            finished.push_back(id);
+        });
+    }
+    {
+        // Disconnect the remaining consoles so their workers finish. Only the
+        // reading side is shut, so a reply being written still goes out.
+        lock_guard<mutex> guard(clientsLock);
+        for (int fd : clients)
+            shutdown(fd, SHUT_RD);
+    }
+    for (auto &worker : workers)
+        worker.second.join();
+    serviceListenFd = -1;
+}
+#endif
+
+// The menu takes checkpoints and compacts the delta log between operations.
+// The service does it every SERVICE_MAINTENANCE_SECONDS with everything
+// locked, so the city files written match the log being retired (every delta
+// is appended under its city's lock) and a checkpoint's snapshot matches its
+// journal offset (every transaction is journaled under its cities' locks).
+void serviceMaintenance() {
+    vector<unique_lock<mutex>> all = lockAllServiceState();
+    if (!checkpointIfDue(false))
+        compactDeltasIfDue();
+}
+
+// Runs the service on "socketPath" until a client sends SHUTDOWN. Returns
+// false if the socket could not be set up.
+bool runService(const string &socketPath) {
+#ifdef _WIN32
+    cout << "Error: the allocation service needs Unix domain sockets, which this platform does not have.\n";
+    return false;
+#else
+    int listenFd = listenOnSocket(socketPath);
+    if (listenFd == -1)
+        return false;
+
+    // Load every city and publish the first copies before any worker starts.
+    // Workers never load a city, so one that cannot be loaded stops the start.
+    for (auto &entry : cityRegistry) {
+        if (!dense.enabled && !cityRecords(entry.first)) {
+            cout << "Error: the allocation service needs every city's records.\n";
+            close(listenFd);
+            unlink(socketPath.c_str());
+            serviceCities.clear();
+            return false;
+        }
+        serviceCities[entry.first];
+    }
+    serviceRunning = true;
+    for (auto &entry : serviceCities)
+        publishCity(entry.first);
+    cout << "Allocation service listening on \"" << socketPath << "\".\n";
+    thread maintenance([]() {
+        for (int tick = 1; !serviceStopping; tick++) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            if (tick % (SERVICE_MAINTENANCE_SECONDS * 10) == 0)
+                serviceMaintenance();
+        }
+    });
+    acceptConnections(listenFd, [](int fd) { serveConnection(fd, handleServiceRequest); });
+    maintenance.join();
+    close(listenFd);
+    unlink(socketPath.c_str());
+    serviceRunning = false;
+    serviceCities.clear();
+    cout << "Allocation service stopped.\n";
+    return true;
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Sharded service ("--serve <socket> --shards N"). The cities are split
+// across N shard processes by a hash of their names. Each shard is this
+// program running the allocation service in its own directory (shards/<i>)
+// with only its cities registered, so it keeps its own snapshot, journal,
+// delta log and checkpoints, and recovers on its own. The coordinator holds
+// no stock: it takes the same requests as the service and routes them over
+// each shard's Unix domain socket ("<socket>.<i>"):
+//  - QUERY goes to the city's shard, and so does an ALLOCATE whose donor and
+//    recipient are on the same shard.
+//  - An ALLOCATE across shards is recorded in the coordinator's transfer log
+//    (see beginTransfer) and then runs in two phases: DEBIT on the donor's
+//    shard, which changes nothing if the stock is not there, then CREDIT on
+//    the recipient's shard. If the credit fails, CANCEL gives the debit back.
+//    Each shard journals its half, tagged with the transfer's id, and the
+//    donor's shard journals a cancellation as one.
+//  - Without a donor, the largest holder is picked from the shards' DONORS
+//    lists, retrying if another console takes the stock first.
+//  - METRO adds up the shards' partial totals; DONORS and SHORTAGES merge the
+//    shards' own lists. These go to every shard at once.
+// The shards apply and log each phase as it happens. A transfer whose
+// outcome the coordinator did not learn, because it died or a shard stopped
+// answering, stays unsettled in the transfer log and is settled when the
+// coordinator next starts.
+//
+// shards/layout.txt records the shard count. On the first sharded start, or
+// when the count changes, every city's current records are exported to its
+// <city>.txt (by running this program with "--export" in this directory or in
+// each old shard), gathered here and dealt out to the new shards. The old
+// shard directories are kept in shards/retired/. "--shards 0" only gathers,
+// to go back to a single process. A city added to registered_cities.txt is
+// given to its shard on the next start.
+// -----------------------------------------------------------------------------
+const char SHARD_DIR[] = "shards";
+const char SHARD_LAYOUT_FILE[] = "shards/layout.txt";
+const char SHARD_LOG_FILE[] = "shard.log";
+const char SHARD_EXPORT_LOG_FILE[] = "shards/export.log";
+const int SHARD_START_SECONDS = 60;
+const int SHARD_STOP_SECONDS = 60;
+const int MAX_SHARDS = 64;
+
+int shardOf(const string &city, int shards) {
+    return (int)(fnv1a(city.data(), city.size()) % shards);
+}
+
+string shardDirectory(int shard) {
+    return string(SHARD_DIR) + "/" + to_string(shard);
+}
+
+#ifndef _WIN32
+struct ShardSet {
+    int count = 0;
+    vector<string> sockets;  // Empty for a shard without cities, which is not started.
+    vector<pid_t> pids;
+};
+ShardSet shardSet;
+
+// A coordinator connection's own connection to each shard, opened on first use.
+struct ShardLink {
+    int fd = -1;
+    string pending;  // Read past the last reply.
+};
+
+int connectToSocket(const string &socketPath) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+        return -1;
+    strcpy(address.sun_path, socketPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+string shardDown(int shard) {
+    return "ERR shard " + to_string(shard) + " is not responding";
+}
+
+bool shardFailed(const string &reply) {
+    return reply.compare(0, 10, "ERR shard ") == 0;
+}
+
+void dropShardLink(ShardLink &link) {
+    if (link.fd != -1)
+        close(link.fd);
+    link.fd = -1;
+    link.pending.clear();
+}
+
+bool sendToShard(vector<ShardLink> &links, int shard, const string &request) {
+    ShardLink &link = links[shard];
+    if (link.fd == -1)
+        link.fd = connectToSocket(shardSet.sockets[shard]);
+    if (link.fd != -1 && writeAll(link.fd, request + "\n"))
+        return true;
+    dropShardLink(link);
+    return false;
+}
+
+string replyFromShard(vector<ShardLink> &links, int shard) {
+    string line;
+    if (links[shard].fd != -1 && readLine(links[shard].fd, links[shard].pending, line))
+        return line;
+    dropShardLink(links[shard]);
+    return shardDown(shard);
+}
+
+string askShard(vector<ShardLink> &links, int shard, const string &request) {
+    return sendToShard(links, shard, request) ? replyFromShard(links, shard) : shardDown(shard);
+}
+
+// Sends "request" to every started shard before reading any reply, so the
+// shards work on it in parallel. Returns the replies.
+vector<string> askAllShards(vector<ShardLink> &links, const string &request) {
+    vector<char> sent(shardSet.count, 0);
+    for (int i = 0; i < shardSet.count; i++) {
+        if (!shardSet.sockets[i].empty())
+            sent[i] = sendToShard(links, i, request);
+    }
+    vector<string> replies;
+    for (int i = 0; i < shardSet.count; i++) {
+        if (!shardSet.sockets[i].empty())
+            replies.push_back(sent[i] ? replyFromShard(links, i) : shardDown(i));
     }
+    return replies;
 }
 
+// The space-separated entries after "OK" in a reply.
+vector<string> replyEntries(const string &reply) {
+    vector<string> entries;
+    if (reply.compare(0, 2, "OK") != 0)
+        return entries;
+    istringstream iss(reply.substr(2));
+    string entry;
+    while (iss >> entry)
+        entries.push_back(entry);
+    return entries;
+}
 
 // -----------------------------------------------------------------------------
-// Loads a single city's dataset from its file and registers it in the system.
+// Transfer log ("shards/transfers.log"). Before the coordinator debits a donor
+// for an allocation across shards, it records the transfer here under a new
+// id, and once the credit is made or the debit given back it records the
+// transfer as settled:
+//   BEGIN id donor recipient item qty
+//   END id
+// At startup every transfer left unsettled is settled before any request is
+// taken: if the recipient's shard journaled the credit, the transfer is
+// complete; otherwise the donor's shard is asked to CANCEL the debit, which it
+// does at most once, and only if it made it. The log is rewritten with just
+// the unsettled transfers when it is opened, and starts over whenever nothing
+// in it is unsettled and it has passed TRANSFER_LOG_COMPACT_BYTES.
 // -----------------------------------------------------------------------------
-void loadCityDataset(const string &city) {
-    string filename = city + ".txt";
-    ifstream infile(filename);
-    if (!infile) {
-        cout << "Error: File \"" << filename << "\" not found!\n";
-        return;
-    }
-    map<string, int> suppliesMap;
-    string line;
+const char TRANSFER_LOG_FILE[] = "shards/transfers.log";
+const unsigned long long TRANSFER_LOG_COMPACT_BYTES = 64 << 10;
+
+struct TransferLog {
+    int fd = -1;
+    bool durable = false;                // fsync after every line ("--fsync").
+    unsigned long long size = 0;         // Bytes in the file.
+    map<string, Transaction> unsettled;  // By id.
+    string idPrefix;                     // Start time and process id, so ids are never reused.
+    unsigned long long nextId = 0;
+    mutex lock;                          // Coordinator connections run in parallel.
+};
+TransferLog transferLog;
+
+// The transfers the log leaves unsettled, by id. A line cut short by a crash
+// is skipped: its transfer was never started, or its END is simply redone.
+map<string, Transaction> readTransferLog() {
+    map<string, Transaction> unsettled;
+    ifstream infile(TRANSFER_LOG_FILE);
+    string line, step;
     while (getline(infile, line)) {
-        if (line.empty()) continue;
         istringstream iss(line);
-        string item;
-        int qty;
-        iss >> item >> qty;
-        suppliesMap[item] += qty;
+        Transaction t;
+        if (!(iss >> step >> t.transfer))
+            continue;
+        if (step == "END")
+            unsettled.erase(t.transfer);
+        else if (step == "BEGIN" && iss >> t.donor >> t.recipient >> t.item >> t.quantity)
+            unsettled[t.transfer] = t;
     }
-    infile.close();
+    return unsettled;
+}
 
-    vector<Supply> supplies;
-    for (auto &entry : suppliesMap) {
-        Supply s;
-        s.city = city;
-        s.itemName = entry.first;
-        s.quantity = entry.second;
-        supplies.push_back(s);
-    }
-    if (!supplies.empty())
-        quickSort(supplies, 0, supplies.size() - 1);
+string transferLogLine(const Transaction &t) {
+    return "BEGIN " + t.transfer + " " + t.donor + " " + t.recipient + " " + t.item + " " +
+           to_string(t.quantity) + "\n";
+}
 
-    cityData[city] = supplies;
-    cout << "City \"" << city << "\" dataset loaded.\n";
+// Appends a line. The caller holds transferLog.lock.
+bool appendTransferLog(const string &line) {
+    if (transferLog.fd == -1 || !writeAll(transferLog.fd, line)) {
+        cout << "Error: could not write to \"" << TRANSFER_LOG_FILE << "\".\n";
+        return false;
+    }
+    if (transferLog.durable)
+        fsync(transferLog.fd);
+    transferLog.size += line.size();
+    return true;
 }
 
-// -----------------------------------------------------------------------------
-// Automatically register (load) all cities from the sample files.
-// -----------------------------------------------------------------------------
-void registerAllCities() {
-    vector<string> cities = {"Mandaluyong", "Caloocan", "Manila", "Paranaque", "Pasay", "QuezonCity", "Pasig"};
-    for (auto &city : cities) {
-        loadCityDataset(city);
+bool openTransferLog(bool durable) {
+    transferLog.durable = durable;
+    transferLog.unsettled = readTransferLog();
+    transferLog.idPrefix = to_string((long long)time(0)) + "-" + to_string((long long)getpid()) + "-";
+    string text;
+    for (auto &entry : transferLog.unsettled)
+        text += transferLogLine(entry.second);
+    if (!writeFileAtomically(TRANSFER_LOG_FILE, text) ||
+        (transferLog.fd = open(TRANSFER_LOG_FILE, O_WRONLY | O_APPEND)) == -1) {
+        cout << "Error: could not open \"" << TRANSFER_LOG_FILE << "\".\n";
+        return false;
     }
-    updateRegisteredCitiesFile();
-    updateMetroManilaData();
+    transferLog.size = text.size();
+    return true;
 }
 
-// -----------------------------------------------------------------------------
-// Option: Allocate resources from one city to another.
-// -----------------------------------------------------------------------------
-void allocateResource() {
-    cout << "\nEnter your city (recipient): ";
-    string recipientCity;
-    getline(cin, recipientCity);
-    if (cityData.find(recipientCity) == cityData.end()) {
-        cout << "Error: City \"" << recipientCity << "\" is not registered in the system.\n";
-        return;
+// Gives "t" a new id and records it before its debit. Returns false if it
+// could not be recorded, in which case the transfer must not start.
+bool beginTransfer(Transaction &t) {
+    lock_guard<mutex> guard(transferLog.lock);
+    t.transfer = transferLog.idPrefix + to_string(transferLog.nextId++);
+    if (!appendTransferLog(transferLogLine(t)))
+        return false;
+    transferLog.unsettled[t.transfer] = t;
+    return true;
+}
+
+void endTransfer(const string &id) {
+    lock_guard<mutex> guard(transferLog.lock);
+    appendTransferLog("END " + id + "\n");
+    transferLog.unsettled.erase(id);
+    if (transferLog.unsettled.empty() && transferLog.size >= TRANSFER_LOG_COMPACT_BYTES &&
+        ftruncate(transferLog.fd, 0) == 0)
+        transferLog.size = 0;
+}
+
+// Settles a transfer whose outcome is not known. Returns false, leaving it
+// unsettled, if a shard did not answer.
+bool settleTransfer(vector<ShardLink> &links, const Transaction &t) {
+    int from = shardOf(t.donor, shardSet.count), to = shardOf(t.recipient, shardSet.count);
+    string phases = askShard(links, to, "TRANSFER " + t.transfer + " " + t.recipient);
+    if (phases.compare(0, 2, "OK") != 0)
+        return false;
+    if (phases.find("CREDIT") == string::npos && askShard(links, from, "CANCEL " + t.transfer + " " + t.donor) != "OK")
+        return false;
+    endTransfer(t.transfer);
+    return true;
+}
+
+// Settles every transfer a previous run left unsettled.
+void settleTransfers() {
+    vector<ShardLink> links(shardSet.count);
+    map<string, Transaction> unsettled = transferLog.unsettled;
+    size_t settled = 0;
+    for (auto &entry : unsettled)
+        settled += settleTransfer(links, entry.second);
+    for (auto &link : links)
+        dropShardLink(link);
+    if (settled > 0)
+        cout << "Settled " << settled << " unfinished transfer(s) between shards.\n";
+    if (settled < unsettled.size())
+        cout << "Warning: " << unsettled.size() - settled << " transfer(s) between shards could not be settled; "
+             << "they are retried on the next start.\n";
+}
+
+string coordinatorAllocate(const string &request, vector<ShardLink> &links) {
+    Transaction t;
+    string error = parseAllocationRequest(request, t);
+    if (!error.empty())
+        return "ERR " + error;
+    string notEnough = t.donor.empty() ? "ERR no donor city has enough \"" + t.item + "\""
+                                       : "ERR donor city \"" + t.donor + "\" does not have enough \"" + t.item + "\"";
+    string amount = " " + t.item + " " + to_string(t.quantity);
+    for (int attempt = 0; attempt < SERVICE_RETRIES; attempt++) {
+        string donor = t.donor;
+        if (donor.empty()) {
+            // Each shard's two largest holders include its largest one other
+            // than the recipient.
+            int most = 0;
+            for (auto &reply : askAllShards(links, "DONORS " + t.item + " 2")) {
+                if (shardFailed(reply))
+                    return reply;
+                for (auto &entry : replyEntries(reply)) {
+                    size_t colon = entry.rfind(':');
+                    int qty = atoi(entry.c_str() + colon + 1);
+                    string city = entry.substr(0, colon);
+                    if (city != t.recipient && qty >= t.quantity && qty > most) {
+                        most = qty;
+                        donor = city;
+                    }
+                }
+            }
+            if (donor.empty())
+                return notEnough;
+        }
+        int from = shardOf(donor, shardSet.count), to = shardOf(t.recipient, shardSet.count);
+        string reply;
+        if (from == to) {
+            reply = askShard(links, from, "ALLOCATE " + t.recipient + amount + " " + donor);
+        } else {
+            Transaction transfer = t;
+            transfer.donor = donor;
+            if (!beginTransfer(transfer))
+                return "ERR the transfer could not be recorded";
+            // A half that was sent but got no answer may still have been made;
+            // its transfer stays unsettled until the next start.
+            string id = " " + transfer.transfer + " ";
+            string unsettled = "; the transfer from \"" + donor + "\" is settled when the service restarts";
+            bool sent = sendToShard(links, from, "DEBIT" + id + donor + " " + t.recipient + amount);
+            reply = sent ? replyFromShard(links, from) : shardDown(from);
+            if (reply == "OK") {
+                sent = sendToShard(links, to, "CREDIT" + id + donor + " " + t.recipient + amount);
+                reply = sent ? replyFromShard(links, to) : shardDown(to);
+                if (reply == "OK") {
+                    endTransfer(transfer.transfer);
+                    return "OK " + donor + " " + to_string(t.quantity);
+                }
+                if ((sent && shardFailed(reply)) || askShard(links, from, "CANCEL" + id + donor) != "OK")
+                    return reply + unsettled;
+                endTransfer(transfer.transfer);
+                return reply;
+            }
+            if (sent && shardFailed(reply))
+                return reply + unsettled;
+            endTransfer(transfer.transfer);
+        }
+        if (reply.compare(0, 2, "OK") == 0 || !t.donor.empty() || reply.find("does not have enough") == string::npos)
+            return reply;
+        // Another console took the stock since the donor was chosen.
     }
-    cout << "Enter the item you need: ";
-    string itemNeeded;
-    getline(cin, itemNeeded);
-    cout << "Enter the quantity needed: ";
-    int qtyNeeded;
-    cin >> qtyNeeded;
-    cin.ignore(); // Remove newline
+    return notEnough;
+}
 
-    vector<string> donorCities;
-    for (auto &entry : cityData) {
-        string donor = entry.first;
-        if (donor == recipientCity)
-            continue;
-        for (auto &s : entry.second) {
-            if (s.itemName == itemNeeded && s.quantity >= qtyNeeded) {
-                donorCities.push_back(donor);
-                break;
+// Handles one request line for the coordinator. Returns the reply, or "" to
+// close the connection.
+string handleCoordinatorRequest(const string &line, vector<ShardLink> &links) {
+    istringstream iss(line);
+    string command, rest;
+    iss >> command;
+    getline(iss, rest);
+    if (command == "ALLOCATE")
+        return coordinatorAllocate(rest, links);
+    if (command == "QUERY") {
+        string city;
+        istringstream(rest) >> city;
+        if (!isRegistered(city))
+            return "ERR city \"" + city + "\" is not registered";
+        return askShard(links, shardOf(city, shardSet.count), line);
+    }
+    if (command == "METRO") {
+        long long total = 0;
+        bool found = false;
+        for (auto &reply : askAllShards(links, line)) {
+            if (shardFailed(reply))
+                return reply;
+            if (reply.compare(0, 3, "OK ") == 0) {
+                total += atoll(reply.c_str() + 3);
+                found = true;
             }
         }
+        string item;
+        istringstream(rest) >> item;
+        if (!found)
+            return "ERR item \"" + item + "\" not found in the Metro Manila dataset";
+        return "OK " + to_string(total);
     }
-    if (donorCities.empty()) {
-        cout << "No donor city has enough \"" << itemNeeded << "\" available.\n";
-        return;
+    if (command == "DONORS") {
+        string item;
+        int k = 0;
+        istringstream(rest) >> item >> k;
+        vector<pair<int, string>> donors;
+        for (auto &reply : askAllShards(links, line)) {
+            if (shardFailed(reply))
+                return reply;
+            for (auto &entry : replyEntries(reply)) {
+                size_t colon = entry.rfind(':');
+                donors.push_back({atoi(entry.c_str() + colon + 1), entry.substr(0, colon)});
+            }
+        }
+        sort(donors.rbegin(), donors.rend());  // Largest first, as one process lists them.
+        string reply = "OK";
+        for (int i = 0; i < k && i < (int)donors.size(); i++)
+            reply += " " + donors[i].second + ":" + to_string(donors[i].first);
+        return reply;
     }
-    cout << "\nDonor cities with available \"" << itemNeeded << "\":\n";
-    for (auto &donor : donorCities) {
-        for (auto &s : cityData[donor]) {
-            if (s.itemName == itemNeeded) {
-                cout << "  " << donor << " - Available: " << s.quantity << "\n";
-                break;
+    if (command == "SHORTAGES") {
+        int k = 0;
+        istringstream(rest) >> k;
+        vector<tuple<int, string, string>> shortages;  // (-shortfall, city, item)
+        for (auto &reply : askAllShards(links, line)) {
+            if (shardFailed(reply))
+                return reply;
+            for (auto &entry : replyEntries(reply)) {
+                size_t first = entry.find(':'), last = entry.rfind(':');
+                shortages.emplace_back(-atoi(entry.c_str() + last + 1), entry.substr(0, first),
+                                       entry.substr(first + 1, last - first - 1));
             }
         }
+        sort(shortages.begin(), shortages.end());
+        string reply = "OK";
+        for (int i = 0; i < k && i < (int)shortages.size(); i++) {
+            reply += " " + get<1>(shortages[i]) + ":" + get<2>(shortages[i]) + ":" +
+                     to_string(-get<0>(shortages[i]));
+        }
+        return reply;
     }
-    cout << "Enter the donor city you want to allocate from: ";
-    string donorCity;
-    getline(cin, donorCity);
-    bool valid = false;
-    for (auto &d : donorCities) {
-        if (d == donorCity) { valid = true; break; }
+    if (command == "QUIT")
+        return "";
+    if (command == "SHUTDOWN") {
+        serviceStopping = true;  // The accept loop is woken once "OK" is sent.
+        return "OK";
     }
-    if (!valid) {
-        cout << "Invalid donor city selection.\n";
-        return;
+    return "ERR unknown command \"" + command + "\"";
+}
+
+// Starts "program" with "args" in "directory", its output going to "logPath".
+// Returns the process id, or -1.
+pid_t startProgram(const string &program, const string &directory, const vector<string> &args,
+                   const string &logPath) {
+    vector<string> words = {program};
+    words.insert(words.end(), args.begin(), args.end());
+    vector<char *> argv;
+    for (auto &word : words)
+        argv.push_back(const_cast<char *>(word.c_str()));
+    argv.push_back(nullptr);
+    cout.flush();
+#ifdef __linux__
+    pid_t parent = getpid();
+#endif
+    pid_t pid = fork();
+    if (pid == 0) {
+#ifdef __linux__
+        // A shard must not outlive its coordinator: the next coordinator
+        // starts a new one in the same directory. It saves and exits on
+        // SIGTERM as on SHUTDOWN.
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent)
+            _exit(1);  // The coordinator died before the signal was set.
+#endif
+        int log = open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (log != -1) {
+            dup2(log, STDOUT_FILENO);
+            dup2(log, STDERR_FILENO);
+        }
+        if (chdir(directory.c_str()) == 0)
+            execv(program.c_str(), argv.data());
+        _exit(127);
     }
-    bool donorUpdated = false;
-    for (auto &s : cityData[donorCity]) {
-        if (s.itemName == itemNeeded) {
-            if (s.quantity < qtyNeeded) {
-                cout << "Error: Donor city \"" << donorCity << "\" does not have enough \""
-                     << itemNeeded << "\".\n";
-                return;
+    return pid;
+}
+
+// Runs "program" to completion. Returns true if it exited with status 0.
+bool runProgram(const string &program, const string &directory, const vector<string> &args,
+                const string &logPath) {
+    pid_t pid = startProgram(program, directory, args, logPath);
+    int status = 0;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Lays the registered cities out over "shards" shard directories (none, for
+// 0), first gathering the inventory here if the shard count changed. Returns
+// false, leaving the old layout in place, if it could not be exported.
+bool prepareShards(int shards, const string &program) {
+    error_code err;
+    int previous = 0;
+    ifstream(SHARD_LAYOUT_FILE) >> previous;
+    filesystem::create_directories(SHARD_DIR, err);
+    size_t unsettled = readTransferLog().size();
+    if (previous != shards && unsettled > 0) {
+        cout << "Error: " << unsettled << " transfer(s) between shards are unsettled; start the service with \"--shards "
+             << previous << "\" to settle them first.\n";
+        return false;
+    }
+    if (previous != shards) {
+        if (previous == 0 && !runProgram(program, ".", {"--export"}, SHARD_EXPORT_LOG_FILE)) {
+            cout << "Error: could not export the inventory; see \"" << SHARD_EXPORT_LOG_FILE << "\".\n";
+            return false;
+        }
+        for (int i = 0; i < previous; i++) {
+            string directory = shardDirectory(i);
+            vector<string> cities = readCityList(directory + "/registered_cities.txt");
+            if (cities.empty())
+                continue;
+            if (!runProgram(program, directory, {"--export"}, SHARD_EXPORT_LOG_FILE)) {
+                cout << "Error: could not export shard " << i << "; see \"" << SHARD_EXPORT_LOG_FILE << "\".\n";
+                return false;
+            }
+            for (auto &city : cities) {
+                filesystem::copy_file(directory + "/" + city + ".txt", city + ".txt",
+                                      filesystem::copy_options::overwrite_existing, err);
+                if (err) {
+                    cout << "Error: could not gather \"" << city << ".txt\" from shard " << i << ".\n";
+                    return false;
+                }
             }
-            s.quantity -= qtyNeeded;
-            donorUpdated = true;
-            break;
         }
+        // Every shard directory left over is retired, not reused.
+        string retired = string(SHARD_DIR) + "/retired/" + to_string(time(nullptr));
+        for (int i = 0; i < MAX_SHARDS; i++) {
+            if (!filesystem::exists(shardDirectory(i)))
+                continue;
+            filesystem::create_directories(retired, err);
+            filesystem::rename(shardDirectory(i), retired + "/" + to_string(i), err);
+        }
+        remove(SHARD_LAYOUT_FILE);
+        if (previous > 0)
+            cout << "Inventory gathered from " << previous << " shard(s).\n";
     }
-    if (!donorUpdated) {
-        cout << "Unexpected error: Donor city \"" << donorCity << "\" does not have the item.\n";
-        return;
+    if (shards == 0)
+        return true;
+
+    vector<vector<string>> owned(shards);
+    set<string> placed;
+    for (int i = 0; i < shards; i++) {
+        owned[i] = readCityList(shardDirectory(i) + "/registered_cities.txt");
+        placed.insert(owned[i].begin(), owned[i].end());
     }
-    bool found = false;
-    for (auto &s : cityData[recipientCity]) {
-        if (s.itemName == itemNeeded) {
-            s.quantity += qtyNeeded;
-            found = true;
-            break;
+    vector<char> changed(shards, 0);
+    for (auto &city : discoverCities()) {
+        if (placed.count(city))
+            continue;
+        int shard = shardOf(city, shards);
+        filesystem::create_directories(shardDirectory(shard), err);
+        filesystem::copy_file(city + ".txt", shardDirectory(shard) + "/" + city + ".txt",
+                              filesystem::copy_options::overwrite_existing, err);
+        owned[shard].push_back(city);
+        changed[shard] = 1;
+    }
+    for (int i = 0; i < shards; i++) {
+        if (!changed[i])
+            continue;
+        ofstream outfile(shardDirectory(i) + "/registered_cities.txt");
+        for (auto &city : owned[i])
+            outfile << city << "\n";
+    }
+    ofstream(SHARD_LAYOUT_FILE) << shards << "\n";
+    return true;
+}
+
+// Waits until every started shard accepts connections. Returns false if one
+// exits, or is not up within SHARD_START_SECONDS.
+bool waitForShards() {
+    for (int i = 0; i < shardSet.count; i++) {
+        if (shardSet.sockets[i].empty())
+            continue;
+        bool up = false;
+        for (int tries = 0; tries < SHARD_START_SECONDS * 20 && shardSet.pids[i] > 0 && !up; tries++) {
+            int fd = connectToSocket(shardSet.sockets[i]);
+            if (fd != -1) {
+                close(fd);
+                up = true;
+            } else if (waitpid(shardSet.pids[i], nullptr, WNOHANG) == shardSet.pids[i]) {
+                shardSet.pids[i] = -1;
+            } else {
+                this_thread::sleep_for(chrono::milliseconds(50));
+            }
+        }
+        if (!up) {
+            cout << "Error: shard " << i << " did not start; see \"" << shardDirectory(i) << "/"
+                 << SHARD_LOG_FILE << "\".\n";
+            return false;
         }
     }
-    if (!found) {
-        Supply newSupply;
-        newSupply.city = recipientCity;
-        newSupply.itemName = itemNeeded;
-        newSupply.quantity = qtyNeeded;
-        cityData[recipientCity].push_back(newSupply);
-        quickSort(cityData[recipientCity], 0, cityData[recipientCity].size() - 1);
+    return true;
+}
+
+// Asks every running shard to save and exit, and waits for them. A shard
+// that cannot be asked, or has not exited after SHARD_STOP_SECONDS, gets
+// SIGTERM, which it handles as SHUTDOWN; it is never killed outright.
+void stopShards() {
+    vector<ShardLink> links(shardSet.count);
+    for (int i = 0; i < shardSet.count; i++) {
+        if (shardSet.pids[i] > 0 && !sendToShard(links, i, "SHUTDOWN"))
+            kill(shardSet.pids[i], SIGTERM);
     }
-    cout << "Allocation successful! " << qtyNeeded << " of \"" << itemNeeded << "\" allocated from \""
-         << donorCity << "\" to \"" << recipientCity << "\".\n";
+    for (int i = 0; i < shardSet.count; i++) {
+        pid_t pid = shardSet.pids[i];
+        bool exited = pid <= 0;
+        for (int tries = 0; tries < SHARD_STOP_SECONDS * 20 && !exited; tries++) {
+            exited = waitpid(pid, nullptr, WNOHANG) == pid;
+            if (!exited)
+                this_thread::sleep_for(chrono::milliseconds(50));
+        }
+        if (!exited) {
+            cout << "Shard " << i << " is still saving; asking it again.\n";
+            kill(pid, SIGTERM);
+            waitpid(pid, nullptr, 0);
+        }
+        shardSet.pids[i] = -1;
+    }
+    for (auto &link : links)
+        dropShardLink(link);
+}
+#endif
 
-    // Log the transaction.
-    logTransaction(donorCity, recipientCity, itemNeeded, qtyNeeded);
-    updateMetroManilaData();
+// Runs the coordinator on "socketPath" over "shards" shard processes of
+// "program" (this executable), started with "shardArgs" after "--serve", with
+// the transfer log fsync'ed if "durable". Returns false if the shards, the
+// transfer log or the socket could not be set up.
+bool runCoordinator(const string &socketPath, int shards, const string &program, const vector<string> &shardArgs,
+                    bool durable) {
+#ifdef _WIN32
+    cout << "Error: the sharded service needs Unix domain sockets, which this platform does not have.\n";
+    return false;
+#else
+    if (!prepareShards(shards, program))
+        return false;
+    shardSet.count = shards;
+    shardSet.sockets.assign(shards, "");
+    shardSet.pids.assign(shards, -1);
+    string base = filesystem::absolute(socketPath).string();
+    for (int i = 0; i < shards; i++) {
+        vector<string> cities = readCityList(shardDirectory(i) + "/registered_cities.txt");
+        if (cities.empty())
+            continue;
+        for (auto &city : cities)
+            cityRegistry[city];  // Known here for routing; the records stay on the shard.
+        shardSet.sockets[i] = base + "." + to_string(i);
+        vector<string> args = {"--serve", shardSet.sockets[i]};
+        args.insert(args.end(), shardArgs.begin(), shardArgs.end());
+        shardSet.pids[i] = startProgram(program, shardDirectory(i), args, shardDirectory(i) + "/" + SHARD_LOG_FILE);
+    }
+    bool up = waitForShards() && openTransferLog(durable);
+    if (up)
+        settleTransfers();
+    int listenFd = up ? listenOnSocket(socketPath) : -1;
+    if (listenFd != -1) {
+        cout << "Coordinator listening on \"" << socketPath << "\" with " << shards << " shard(s) for "
+             << cityRegistry.size() << " cities.\n";
+        acceptConnections(listenFd, [](int fd) {
+            vector<ShardLink> links(shardSet.count);
+            serveConnection(fd, [&links](const string &line) { return handleCoordinatorRequest(line, links); });
+            for (auto &link : links)
+                dropShardLink(link);
+        });
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+    stopShards();
+    if (transferLog.fd != -1)
+        close(transferLog.fd);
+    transferLog.fd = -1;
+    if (listenFd != -1)
+        cout << "Coordinator stopped.\n";
+    return listenFd != -1;
+#endif
 }
 
 // -----------------------------------------------------------------------------
@@ -467,17 +5327,17 @@ void showCityDataset() {
     cout << "\nEnter city name to display its dataset: ";
     string city;
     getline(cin, city);
-    if (cityData.find(city) == cityData.end()) {
+    if (!isRegistered(city)) {
         cout << "City \"" << city << "\" is not registered in the system.\n";
         return;
     }
-    vector<Supply> citySupplies = cityData[city];
-    if (!citySupplies.empty())
-        quickSort(citySupplies, 0, citySupplies.size() - 1);
+    vector<Supply> supplies = citySupplies(city);
     cout << "\nDataset for \"" << city << "\" (sorted using quick sort):\n";
-    for (auto &s : citySupplies) {
-        cout << "  " << s.itemName << " : " << s.quantity << "\n";
+    for (const Supply *s : byItemName(supplies)) {
+        cout << "  " << itemName(s->itemId) << " : " << s->quantity << "\n";
     }
+    const CityInfo &info = cityRegistry[city];
+    cout << info.itemCount << " items, " << info.totalUnits << " units in total.\n";
 }
 
 // -----------------------------------------------------------------------------
@@ -489,12 +5349,64 @@ void showMetroManilaDataset() {
         return;
     }
     cout << "\nConsolidated Metro Manila dataset (sorted using merge sort):\n";
-    for (auto &s : metroManilaData) {
-        cout << "  " << s.itemName << " : " << s.quantity << "\n";
+    for (const Supply *s : byItemName(metroManilaData)) {
+        cout << "  " << itemName(s->itemId) << " : " << s->quantity << "\n";
     }
+    flushMetroManilaData(true);
     cout << "The consolidated dataset has been saved to \"metro_manila.txt\".\n";
 }
 
+// -----------------------------------------------------------------------------
+// Item matches for the search options, with their quantities: in "city", or
+// (if it is empty) across Metro Manila plus the largest holding cities.
+// -----------------------------------------------------------------------------
+const size_t SUGGESTION_LIMIT = 5;
+const size_t PREFIX_MATCH_LIMIT = 25;
+const size_t HOLDERS_SHOWN = 5;
+
+void printItemMatch(ItemId item, const string &city) {
+    cout << "  " << itemName(item) << " : ";
+    if (!city.empty()) {
+        int quantity;
+        if (cityQuantity(city, item, quantity))
+            cout << quantity << " in " << city << "\n";
+        else
+            cout << "none in " << city << "\n";
+        return;
+    }
+    int index = binarySearch(metroManilaData, item);
+    cout << (index != -1 ? metroManilaData[index].quantity : 0);
+    if (item < donorIndex.size() && !donorIndex[item].empty()) {
+        const set<pair<int, string>> &holders = donorIndex[item];
+        cout << " (";
+        size_t shown = 0;
+        for (auto h = holders.rbegin(); h != holders.rend() && shown < HOLDERS_SHOWN; ++h, ++shown)
+            cout << (shown ? ", " : "") << h->second << " " << h->first;
+        if (holders.size() > shown)
+            cout << ", " << holders.size() - shown << " more cities";
+        cout << ")";
+    }
+    cout << "\n";
+}
+
+// Prints a few items that start with, or are spelled like, "text".
+void printItemSuggestions(const string &text, const string &city) {
+    vector<ItemId> suggestions = itemsWithPrefix(text);
+    if (suggestions.size() > SUGGESTION_LIMIT)
+        suggestions.resize(SUGGESTION_LIMIT);
+    for (auto &near : itemsNear(text, fuzzyTolerance(text))) {
+        if (suggestions.size() >= SUGGESTION_LIMIT)
+            break;
+        if (find(suggestions.begin(), suggestions.end(), near.second) == suggestions.end())
+            suggestions.push_back(near.second);
+    }
+    if (suggestions.empty())
+        return;
+    cout << "Did you mean:\n";
+    for (ItemId item : suggestions)
+        printItemMatch(item, city);
+}
+
 // -----------------------------------------------------------------------------
 // Option: Search for a specific item using Binary Search.
 // -----------------------------------------------------------------------------
@@ -507,22 +5419,21 @@ void searchItem() {
         cout << "Enter city name: ";
         string city;
         getline(cin, city);
-        if (cityData.find(city) == cityData.end()) {
+        if (!isRegistered(city)) {
             cout << "City \"" << city << "\" is not registered in the system.\n";
             return;
         }
-        vector<Supply> citySupplies = cityData[city];
-        if (!citySupplies.empty())
-            quickSort(citySupplies, 0, citySupplies.size() - 1);
         cout << "Enter item name to search: ";
         string item;
         getline(cin, item);
-        int index = binarySearch(citySupplies, item);
-        if (index != -1) {
-            cout << "Found: \"" << citySupplies[index].itemName << "\" in \"" << city
-                 << "\" with quantity " << citySupplies[index].quantity << "\n";
+        ItemId id;
+        int quantity;
+        if (findItemId(item, id) && cityQuantity(city, id, quantity)) {
+            cout << "Found: \"" << itemName(id) << "\" in \"" << city
+                 << "\" with quantity " << quantity << "\n";
         } else {
             cout << "Item \"" << item << "\" not found in \"" << city << "\".\n";
+            printItemSuggestions(item, city);
         }
     } else if (choice == 2) {
         if (metroManilaData.empty()) {
@@ -534,38 +5445,422 @@ void searchItem() {
         getline(cin, item);
         int index = binarySearch(metroManilaData, item);
         if (index != -1) {
-            cout << "Found: \"" << metroManilaData[index].itemName
+            cout << "Found: \"" << itemName(metroManilaData[index].itemId)
                  << "\" with consolidated quantity " << metroManilaData[index].quantity << "\n";
         } else {
             cout << "Item \"" << item << "\" not found in the Metro Manila dataset.\n";
+            printItemSuggestions(item, "");
         }
     } else {
         cout << "Invalid choice.\n";
     }
 }
 
+// -----------------------------------------------------------------------------
+// Option: Show the cities holding the most of an item (from the donor index).
+// -----------------------------------------------------------------------------
+void showTopDonors() {
+    cout << "\nEnter item name: ";
+    string item;
+    getline(cin, item);
+    cout << "How many cities to show: ";
+    int k;
+    cin >> k;
+    cin.ignore();
+    vector<pair<string, int>> donors = topDonors(item, k);
+    if (donors.empty()) {
+        cout << "No city holds \"" << item << "\".\n";
+        return;
+    }
+    cout << "\nTop donor cities for \"" << item << "\":\n";
+    for (auto &donor : donors) {
+        cout << "  " << donor.first << " - Available: " << donor.second << "\n";
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Option: Show every item's stock across the cities holding it, and which
+// cities hold less of an item than a threshold.
+// -----------------------------------------------------------------------------
+void showStockLevels() {
+    cout << "\nLow-stock threshold: ";
+    int threshold;
+    cin >> threshold;
+    cin.ignore();
+    ItemStats stats;
+    itemStats(threshold, stats);
+    vector<ItemId> items;
+    for (ItemId item = 0; item < stats.holders.size(); item++) {
+        if (stats.holders[item] > 0)
+            items.push_back(item);
+    }
+    sort(items.begin(), items.end(), [](ItemId a, ItemId b) { return itemName(a) < itemName(b); });
+    cout << "\nStock levels (total / lowest / highest / cities below " << threshold << "):\n";
+    for (ItemId item : items) {
+        cout << "  " << itemName(item) << " : " << stats.total[item] << " / " << stats.minimum[item]
+             << " / " << stats.maximum[item] << " / " << stats.below[item] << " of "
+             << stats.holders[item] << "\n";
+    }
+    cout << "Show the cities below " << threshold << " for item (leave blank to skip): ";
+    string item;
+    getline(cin, item);
+    ItemId id;
+    if (item.empty() || !findItemId(item, id))
+        return;
+    vector<pair<string, int>> cities = citiesBelow(id, threshold);
+    if (cities.empty()) {
+        cout << "No city holds less than " << threshold << " of \"" << item << "\".\n";
+        return;
+    }
+    for (auto &city : cities) {
+        cout << "  " << city.first << " - Available: " << city.second << "\n";
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Option: Find items by the start of their name or by a misspelled name, with
+// their Metro Manila and per-city quantities.
+// -----------------------------------------------------------------------------
+void findItems() {
+    cout << "\nEnter the start of an item name, or an item name spelled roughly: ";
+    string text;
+    getline(cin, text);
+    if (text.empty())
+        return;
+    vector<ItemId> prefixed = itemsWithPrefix(text);
+    if (!prefixed.empty()) {
+        cout << "\nItems starting with \"" << text << "\" (Metro Manila total, largest holders):\n";
+        for (size_t i = 0; i < prefixed.size() && i < PREFIX_MATCH_LIMIT; i++)
+            printItemMatch(prefixed[i], "");
+        if (prefixed.size() > PREFIX_MATCH_LIMIT)
+            cout << "  ... and " << prefixed.size() - PREFIX_MATCH_LIMIT << " more.\n";
+    }
+    vector<pair<int, ItemId>> near = itemsNear(text, fuzzyTolerance(text));
+    bool heading = false;
+    for (auto &match : near) {
+        if (binary_search(prefixed.begin(), prefixed.end(), match.second,
+                                              [](ItemId a, ItemId b) { return itemName(a) < itemName(b); }))
+            continue;
+        if (!heading) {
+            cout << "\nItems spelled like \"" << text << "\":\n";
+            heading = true;
+        }
+        printItemMatch(match.second, "");
+    }
+    if (prefixed.empty() && !heading)
+        cout << "No items start with or are spelled like \"" << text << "\".\n";
+}
+
+// -----------------------------------------------------------------------------
+// Option: Show the worst low-stock shortages metro-wide, and change an item's
+// reorder threshold.
+// -----------------------------------------------------------------------------
+const size_t SHORTAGES_SHOWN = 20;
+
+bool saveReorderThresholds() {
+    string text;
+    if (watchlist.defaultThreshold > 0)
+        text += "* " + to_string(watchlist.defaultThreshold) + "\n";
+    vector<ItemId> items;
+    for (ItemId item = 0; item < watchlist.perItem.size(); item++) {
+        if (watchlist.perItem[item] != THRESHOLD_DEFAULT)
+            items.push_back(item);
+    }
+    sort(items.begin(), items.end(), [](ItemId a, ItemId b) { return itemName(a) < itemName(b); });
+    for (ItemId item : items)
+        text += itemName(item) + " " + to_string(watchlist.perItem[item]) + "\n";
+    return writeFileAtomically(REORDER_THRESHOLDS_FILE, text);
+}
+
+void showLowStockWatchlist() {
+    cout << "\nHow many shortages to show (default " << SHORTAGES_SHOWN << "): ";
+    string line;
+    getline(cin, line);
+    size_t count = line.empty() ? SHORTAGES_SHOWN : strtoul(line.c_str(), nullptr, 10);
+    vector<Shortage> worst = worstShortages(count);
+    if (worst.empty()) {
+        cout << "No city is below the reorder threshold of any item.\n";
+    } else {
+        cout << "\nWorst shortages (" << worst.size() << " of " << watchlist.shortages.size() << "):\n";
+        for (auto &s : worst) {
+            int threshold = reorderThreshold(s.item);
+            cout << "  " << s.city << " - " << itemName(s.item) << " : " << threshold - s.shortfall
+                 << " of " << threshold << " (short " << s.shortfall << ")\n";
+        }
+    }
+    cout << "Change the reorder threshold of item (\"*\" for the default, leave blank to skip): ";
+    string item;
+    getline(cin, item);
+    if (item.empty())
+        return;
+    cout << "New threshold (leave blank to use the default): ";
+    getline(cin, line);
+    int threshold = line.empty() ? THRESHOLD_DEFAULT : atoi(line.c_str());
+    if (threshold < 0 && (item == "*" || !line.empty())) {
+        cout << "Error: the threshold must be zero or more.\n";
+        return;
+    }
+    if (item == "*") {
+        watchlist.defaultThreshold = threshold;
+        rebuildWatchlist();  // Every item without its own threshold changes.
+    } else {
+        setReorderThreshold(internItem(item), threshold);
+    }
+    if (saveReorderThresholds())
+        cout << "Reorder thresholds saved to \"" << REORDER_THRESHOLDS_FILE << "\" ("
+             << watchlist.shortages.size() << " shortage(s) now).\n";
+    else
+        cout << "Error: could not write \"" << REORDER_THRESHOLDS_FILE << "\".\n";
+}
+
+// -----------------------------------------------------------------------------
+// Option: Show the performance statistics, and optionally save them.
+// -----------------------------------------------------------------------------
+void showStats() {
+    cout << "\n=== Performance Statistics ===\n" << formatStats();
+    cout << "Save them to \"" << STATS_FILE << "\"? (y/n): ";
+    string answer;
+    getline(cin, answer);
+    if (answer != "y" && answer != "Y")
+        return;
+    if (saveStats())
+        cout << "Statistics saved to \"" << STATS_FILE << "\".\n";
+    else
+        cout << "Error: could not write \"" << STATS_FILE << "\".\n";
+}
+
+// -----------------------------------------------------------------------------
+// Option: Show what a city (or all of Metro Manila) held at a past time.
+// -----------------------------------------------------------------------------
+void showInventoryAsOf() {
+    cout << "\nCity (leave blank for Metro Manila): ";
+    string city;
+    getline(cin, city);
+    if (!city.empty() && !isRegistered(city)) {
+        cout << "Error: City \"" << city << "\" is not registered in the system.\n";
+        return;
+    }
+    cout << "Date and time (YYYY-MM-DD HH:MM[:SS]): ";
+    string input;
+    getline(cin, input);
+    tm when = {};
+    int fields = sscanf(input.c_str(), "%d-%d-%d %d:%d:%d", &when.tm_year, &when.tm_mon, &when.tm_mday,
+                        &when.tm_hour, &when.tm_min, &when.tm_sec);
+    if (fields < 5) {
+        cout << "Invalid date and time.\n";
+        return;
+    }
+    when.tm_year -= 1900;
+    when.tm_mon -= 1;
+    when.tm_isdst = -1;
+    long long asOf = (long long)mktime(&when);
+
+    InventoryView view;
+    string source;
+    if (!inventoryAsOf(city, asOf, view, source)) {
+        cout << "Error: could not read the checkpoint to rebuild from.\n";
+        return;
+    }
+    map<string, long long> totals;
+    for (auto &entry : view) {
+        for (auto &item : entry.second)
+            totals[item.first] += item.second;
+    }
+    cout << "\n" << (city.empty() ? "Metro Manila" : city) << " as of " << formatTime(asOf)
+         << " (from the " << source << "):\n";
+    for (auto &item : totals) {
+        cout << "  " << item.first << " : " << item.second << "\n";
+    }
+}
+
 // -----------------------------------------------------------------------------
 // Main menu
 // -----------------------------------------------------------------------------
-int main() {
-    // Create sample data files if they do not exist.
-    initializeSampleFiles();
-    // Automatically register all cities.
-    registerAllCities();
+// Builds that include this file for its functions (benchmark.cpp) define
+// RELIEF_NO_MAIN to supply their own main.
+#ifndef RELIEF_NO_MAIN
+int main(int argc, char *argv[]) {
+    // Command line: "--batch <file>" applies the file and exits (non-interactive);
+    // "--fsync" makes every journal group commit durable on disk; "--import"
+    // reloads the city text files instead of the inventory snapshot;
+    // "--memory-budget <MB>" caps the memory used by loaded city records;
+    // "--dense" keeps all quantities in a city x item matrix; "--serve <socket>"
+    // runs the allocation service instead of the menu; "--split-batch <file>"
+    // plans and applies the file with the split solver and exits;
+    // "--stats-on-exit" saves the performance statistics when the program ends;
+    // "--shards <N>" with "--serve" runs the service as a coordinator over N
+    // shard processes, each started with the options above that apply to it
+    // ("--shards 0" gathers the shards' inventory back here and exits);
+    // "--export" writes every city's records to its text file and exits.
+    string batchFile, socketPath, splitBatchFile, rebalanceTarget;
+    JournalDurability durability = JOURNAL_BUFFERED;
+    bool importText = false;
+    bool denseStorage = false;
+    bool exportOnly = false;
+    int shards = -1;
+    vector<string> shardArgs;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--batch" && i + 1 < argc) {
+            batchFile = argv[++i];
+        } else if (arg == "--fsync") {
+            durability = JOURNAL_FSYNC;
+            shardArgs.push_back(arg);
+        } else if (arg == "--import") {
+            importText = true;
+        } else if (arg == "--memory-budget" && i + 1 < argc) {
+            cityMemoryBudget = (size_t)atoll(argv[++i]) << 20;
+            shardArgs.insert(shardArgs.end(), {arg, argv[i]});
+        } else if (arg == "--dense") {
+            denseStorage = true;
+            shardArgs.push_back(arg);
+        } else if (arg == "--shards" && i + 1 < argc && atoi(argv[i + 1]) >= 0 && atoi(argv[i + 1]) <= MAX_SHARDS) {
+            shards = atoi(argv[++i]);
+        } else if (arg == "--export") {
+            exportOnly = true;
+        } else if (arg == "--serve" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (arg == "--split-batch" && i + 1 < argc) {
+            splitBatchFile = argv[++i];
+        } else if (arg == "--stats-on-exit") {
+            saveStatsOnExit = true;
+            shardArgs.push_back(arg);
+        } else if (arg == "--rebalance" && i + 1 < argc && (argv[i + 1] == string("mean") ||
+                                                            argv[i + 1] == string("demand"))) {
+            rebalanceTarget = argv[++i];
+        } else {
+            cout << "Usage: " << argv[0] << " [--batch <file>] [--fsync] [--import] [--memory-budget <MB>] [--dense]"
+                 << " [--serve <socket>] [--split-batch <file>] [--stats-on-exit] [--rebalance mean|demand]"
+                 << " [--shards <0-" << MAX_SHARDS << ">] [--export]\n";
+            return 1;
+        }
+    }
+
+    // The coordinator keeps no inventory of its own, so it starts before
+    // anything is loaded.
+    if (shards > 0 && socketPath.empty()) {
+        cout << "Error: \"--shards\" needs \"--serve <socket>\".\n";
+        return 1;
+    }
+    if (shards >= 0) {
+        if (!lockForProcess(COORDINATOR_LOCK_FILE)) {
+            cout << "Error: another coordinator is running in this directory (\"" << COORDINATOR_LOCK_FILE
+                 << "\" is locked).\n";
+            return 1;
+        }
+        error_code err;
+        string program = filesystem::read_symlink("/proc/self/exe", err).string();
+        if (err)
+            program = filesystem::absolute(argv[0]).string();
+        if (shards == 0)
+            return prepareShards(0, program) ? 0 : 1;
+        return runCoordinator(socketPath, shards, program, shardArgs, durability == JOURNAL_FSYNC) ? 0 : 1;
+    }
+    if (!lockForProcess(INVENTORY_LOCK_FILE)) {
+        cout << "Error: another process is using the inventory in this directory (\"" << INVENTORY_LOCK_FILE
+             << "\" is locked).\n";
+        return 1;
+    }
+    if (filesystem::exists(SHARD_LAYOUT_FILE)) {
+        cout << "Warning: the inventory is split across shards (\"" << SHARD_LAYOUT_FILE
+             << "\"); run with \"--shards 0\" to gather it here first.\n";
+    }
+
+    // Restore the last saved state, or register all cities from their text
+    // files (creating the sample files if they do not exist).
+    // Text files loaded now (imported, or edited since the snapshot) changed
+    // the inventory outside the journal, so they need a new checkpoint.
+    bool fromSnapshot = !importText && loadInventorySnapshot();
+    bool textLoaded = !fromSnapshot;
+    for (auto &entry : cityRegistry)
+        textLoaded = textLoaded || !entry.second.inSnapshot;
+    if (!fromSnapshot) {
+        initializeSampleFiles();
+        registerAllCities();
+    }
+    loadReorderThresholds();
+    // Changes made after the inventory was last saved (e.g. before a crash)
+    // are still in the delta log.
+    size_t recovered = openDeltaLog(durability == JOURNAL_FSYNC);
+    if (recovered > 0)
+        cout << "Recovered " << recovered << " unsaved inventory change(s) from \"" << DELTA_FILE << "\".\n";
+    if (!fromSnapshot) {
+        saveInventorySnapshot();
+        enforceCityMemoryBudget();
+    }
+    if (denseStorage) {
+        buildDenseInventory();
+        rebuildMetroFromDense();
+    }
+    openJournal(durability);
+    checkpointIfDue(textLoaded || recovered > 0);
+
+    if (exportOnly) {
+        exportCityDatasets();
+        shutdownSystem();
+        return 0;
+    }
+    if (!batchFile.empty()) {
+        runBatchFile(batchFile);
+        shutdownSystem();
+        return 0;
+    }
+    if (!splitBatchFile.empty()) {
+        ifstream infile(splitBatchFile);
+        if (!infile)
+            cout << "Error: File \"" << splitBatchFile << "\" not found!\n";
+        else
+            processSplitBatch(infile, false);
+        shutdownSystem();
+        return 0;
+    }
+    if (!rebalanceTarget.empty()) {
+        processRebalance(rebalanceTarget == "demand", DEFAULT_REBALANCE_TOLERANCE, "", false);
+        shutdownSystem();
+        return 0;
+    }
+    if (!socketPath.empty()) {
+        bool served = runService(socketPath);
+        shutdownSystem();
+        return served ? 0 : 1;
+    }
 
     int option;
     do {
+        // Nothing else happens while waiting for input, so take a checkpoint
+        // or compact the delta log if one is due and trim the loaded cities
+        // now.
+        if (!checkpointIfDue(false))
+            compactDeltasIfDue();
+        enforceCityMemoryBudget();
         cout << "\n=== Disaster Relief Allocation System ===\n";
         cout << "1. Show consolidated Metro Manila dataset\n";
         cout << "2. Allocate resources\n";
         cout << "3. Show city dataset\n";
         cout << "4. Search for item (using Binary Search)\n";
         cout << "5. View historical transactions\n";
+        // Exit stays 6, as it always was, and new options are added at the
+        // end, so scripted input keeps meaning the same thing.
         cout << "6. Exit\n";
+        cout << "7. Show top donor cities for an item\n";
+        cout << "8. Allocate resources from a batch file\n";
+        cout << "9. Save consolidated dataset and inventory snapshot\n";
+        cout << "10. Export historical transactions to text file\n";
+        cout << "11. Query historical transactions\n";
+        cout << "12. Export city datasets to text files\n";
+        cout << "13. Show stock levels by item\n";
+        cout << "14. Allocate a batch file with split donors\n";
+        cout << "15. Show performance statistics\n";
+        cout << "16. Show inventory at a past time\n";
+        cout << "17. Find items by prefix or spelling\n";
+        cout << "18. Show low-stock watchlist\n";
+        cout << "19. Rebalance stock across cities\n";
         cout << "Enter option: ";
 
         if (!(cin >> option)) {
-            cout << "Invalid input. Please enter a number between 1 and 6." << endl;
+            if (cin.eof()) // Input closed (e.g. piped input ran out).
+                break;
+            cout << "Invalid input. Please enter a number between 1 and 19." << endl;
             cin.clear(); // Clear the error flag
             cin.ignore(numeric_limits <streamsize>::max(), '\n'); // Discard invalid input
             continue; // Skip the rest of the loop and prompt again
@@ -591,10 +5886,54 @@ int main() {
             case 6:
                 cout << "Exiting system.\n";
                 break;
+            case 7:
+                showTopDonors();
+                break;
+            case 8:
+                allocateFromBatchFile();
+                break;
+            case 9:
+                flushMetroManilaData(true);
+                cout << "Consolidated dataset saved to \"metro_manila.txt\".\n";
+                if (saveInventorySnapshot())
+                    cout << "Inventory snapshot saved to \"" << SNAPSHOT_FILE << "\".\n";
+                break;
+            case 10:
+                exportTransactions();
+                break;
+            case 11:
+                queryTransactions();
+                break;
+            case 12:
+                exportCityDatasets();
+                break;
+            case 13:
+                showStockLevels();
+                break;
+            case 14:
+                allocateFromSplitBatchFile();
+                break;
+            case 15:
+                showStats();
+                break;
+            case 16:
+                showInventoryAsOf();
+                break;
+            case 17:
+                findItems();
+                break;
+            case 18:
+                showLowStockWatchlist();
+                break;
+            case 19:
+                rebalanceInventory();
+                break;
             default:
                 cout << "Invalid option. Please try again.\n";
         }
     } while (option != 6);
 
+    shutdownSystem();
     return 0;
 }
+#endif
@@ -0,0 +1,515 @@
+// =============================================================================
+// Benchmark suite for the Disaster Relief Allocation System.
+//
+// Generates a synthetic dataset (city files with a configurable number of
+// cities and items, duplicate lines and pre-sortedness) in a scratch directory
+// and times the system's own functions on it: loadCityDataset, quickSort,
+// mergeSort, binarySearch, the prefix and fuzzy item searches,
+// updateMetroManilaData, planning a metro-wide rebalancing and end-to-end
+// allocations. Given the built program ("--relief"), it also measures the
+// allocation service's throughput with the cities split over each of the
+// "--shard-counts" shard processes.
+// Results are printed as one JSON object per line, so runs can be compared by
+// a script.
+//
+// Build: g++ -std=c++17 -O2 -pthread benchmark.cpp -o relief_bench
+// =============================================================================
+#define RELIEF_NO_MAIN
+#include "Activity 2.cpp"
+#include <random>
+
+// -----------------------------------------------------------------------------
+// Settings, from the command line.
+// -----------------------------------------------------------------------------
+struct BenchConfig {
+    string directory = "bench_data";
+    int cities = 200;
+    int items = 1000;
+    double duplicateRate = 0.1;  // Extra lines that repeat an item, per item.
+    double sortedness = 0.0;     // Fraction of lines left in item order.
+    int rounds = 5;              // Passes over the cities for the load, sort and metro runs.
+    int searches = 100000;
+    int itemQueries = 2000;      // For each of the prefix and fuzzy item searches.
+    int allocations = 10000;
+    unsigned seed = 1;
+    string relief;               // The program, for the sharded service runs (none if empty).
+    vector<int> shardCounts = {1, 2, 4};
+    int clients = 4;             // Connections sending requests at once.
+    int serviceRequests = 2000;  // Per connection.
+};
+
+// -----------------------------------------------------------------------------
+// Timings: a latency per operation, summarized as throughput and percentiles.
+// -----------------------------------------------------------------------------
+typedef chrono::steady_clock BenchClock;
+
+struct BenchResult {
+    string name;
+    vector<double> latencies;  // Microseconds per operation.
+    double seconds = 0;        // Wall time of the whole run.
+};
+
+double elapsedMicros(BenchClock::time_point start) {
+    return chrono::duration<double, micro>(BenchClock::now() - start).count();
+}
+
+double percentile(const vector<double> &sorted, double q) {
+    if (sorted.empty())
+        return 0;
+    size_t i = min(sorted.size() - 1, (size_t)(q * sorted.size()));
+    return sorted[i];
+}
+
+void printResult(BenchResult &result) {
+    vector<double> &v = result.latencies;
+    sort(v.begin(), v.end());
+    cout << fixed << setprecision(3) << "{\"benchmark\":\"" << result.name << "\",\"ops\":" << v.size()
+         << ",\"seconds\":" << result.seconds
+         << ",\"ops_per_sec\":" << (result.seconds > 0 ? v.size() / result.seconds : 0)
+         << ",\"p50_us\":" << percentile(v, 0.50) << ",\"p90_us\":" << percentile(v, 0.90)
+         << ",\"p99_us\":" << percentile(v, 0.99) << ",\"max_us\":" << (v.empty() ? 0 : v.back()) << "}\n";
+}
+
+// Swallows the "dataset loaded" and similar messages while a run is timed.
+struct NullBuffer : streambuf {
+    int overflow(int c) override { return c; }
+};
+
+// -----------------------------------------------------------------------------
+// Synthetic dataset. Item names are zero-padded and interned in name order
+// before anything is loaded, so item id order is the same as file order when
+// a file is sorted. Every city lists every item once, plus duplicateRate
+// extra lines per item that repeat a random item. The lines start out in item
+// order, then (1 - sortedness) of them are shuffled among themselves.
+// "records" keeps each city's lines in file order for the sort runs.
+// -----------------------------------------------------------------------------
+struct BenchDataset {
+    vector<string> cities;
+    vector<vector<Supply>> records;
+};
+
+string benchItemName(int i) {
+    char name[16];
+    snprintf(name, sizeof(name), "item%06d", i);
+    return name;
+}
+
+BenchDataset generateDataset(const BenchConfig &config, mt19937 &rng) {
+    BenchDataset data;
+    vector<ItemId> ids;
+    for (int i = 0; i < config.items; i++)
+        ids.push_back(internItem(benchItemName(i)));
+
+    uniform_int_distribution<int> anyItem(0, config.items - 1), anyQty(0, 1000);
+    uniform_real_distribution<double> unit(0, 1);
+    for (int c = 0; c < config.cities; c++) {
+        string city = "City" + to_string(c);
+        vector<int> lines;
+        for (int i = 0; i < config.items; i++)
+            lines.push_back(i);
+        size_t extra = (size_t)(config.duplicateRate * config.items);
+        for (size_t i = 0; i < extra; i++)
+            lines.push_back(anyItem(rng));
+        sort(lines.begin(), lines.end());
+
+        vector<size_t> moved;
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (unit(rng) >= config.sortedness)
+                moved.push_back(i);
+        }
+        vector<int> movedItems;
+        for (size_t i : moved)
+            movedItems.push_back(lines[i]);
+        shuffle(movedItems.begin(), movedItems.end(), rng);
+        for (size_t i = 0; i < moved.size(); i++)
+            lines[moved[i]] = movedItems[i];
+
+        string text;
+        vector<Supply> records;
+        for (int item : lines) {
+            Supply s;
+            s.itemId = ids[item];
+            s.quantity = anyQty(rng);
+            records.push_back(s);
+            text += benchItemName(item) + " " + to_string(s.quantity) + "\n";
+        }
+        if (!writeFileAtomically(city + ".txt", text))
+            cerr << "Error: could not write \"" << city << ".txt\".\n";
+        data.cities.push_back(city);
+        data.records.push_back(move(records));
+    }
+    return data;
+}
+
+// -----------------------------------------------------------------------------
+// The runs.
+// -----------------------------------------------------------------------------
+BenchResult benchLoad(const BenchConfig &config, const BenchDataset &data) {
+    BenchResult result;
+    result.name = "loadCityDataset";
+    BenchClock::time_point start = BenchClock::now();
+    for (int round = 0; round < config.rounds; round++) {
+        for (const string &city : data.cities) {
+            BenchClock::time_point t = BenchClock::now();
+            loadCityDataset(city);
+            result.latencies.push_back(elapsedMicros(t));
+        }
+    }
+    result.seconds = elapsedMicros(start) / 1e6;
+    return result;
+}
+
+// Sorts a copy of every city's records, in file order, sorted order or
+// reverse sorted order. Only the sort itself is timed.
+BenchResult benchSort(const BenchConfig &config, const BenchDataset &data, const string &sortName,
+                      const string &order, void (*sortFunction)(vector<Supply> &, int, int)) {
+    BenchResult result;
+    result.name = sortName + "/" + order;
+    for (int round = 0; round < config.rounds; round++) {
+        for (const vector<Supply> &records : data.records) {
+            vector<Supply> copy = records;
+            if (order != "file")
+                sort(copy.begin(), copy.end(), compareSupply);
+            if (order == "reversed")
+                reverse(copy.begin(), copy.end());
+            BenchClock::time_point t = BenchClock::now();
+            if (!copy.empty())
+                sortFunction(copy, 0, copy.size() - 1);
+            double micros = elapsedMicros(t);
+            result.latencies.push_back(micros);
+            result.seconds += micros / 1e6;
+        }
+    }
+    return result;
+}
+
+// Lookups are timed in groups of SEARCH_GROUP, since a single search is
+// close to the resolution of the clock; each lookup's latency is its group's
+// average.
+const int SEARCH_GROUP = 64;
+
+BenchResult benchSearch(const BenchConfig &config, const BenchDataset &data, mt19937 &rng) {
+    BenchResult result;
+    result.name = "binarySearch";
+    uniform_int_distribution<int> anyCity(0, config.cities - 1), anyItem(0, config.items - 1);
+    vector<pair<const vector<Supply> *, ItemId>> lookups;
+    for (int i = 0; i < config.searches; i++) {
+        ItemId item;
+        findItemId(benchItemName(anyItem(rng)), item);
+        lookups.push_back({cityRecords(data.cities[anyCity(rng)]), item});
+    }
+    long long found = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for (size_t i = 0; i < lookups.size(); i += SEARCH_GROUP) {
+        size_t end = min(lookups.size(), i + SEARCH_GROUP);
+        BenchClock::time_point t = BenchClock::now();
+        for (size_t j = i; j < end; j++)
+            found += binarySearch(*lookups[j].first, lookups[j].second) != -1;
+        double each = elapsedMicros(t) / (end - i);
+        result.latencies.insert(result.latencies.end(), end - i, each);
+    }
+    result.seconds = elapsedMicros(start) / 1e6;
+    if (found != (long long)lookups.size())
+        cerr << "Warning: " << lookups.size() - found << " searches missed.\n";
+    return result;
+}
+
+// Item name searches over the dictionary: a prefix of a random item's name
+// (autocomplete), and a random item's name with one character deleted,
+// replaced or inserted (fuzzy search).
+BenchResult benchItemSearch(const BenchConfig &config, mt19937 &rng, bool fuzzy) {
+    BenchResult result;
+    result.name = fuzzy ? "itemsNear" : "itemsWithPrefix";
+    uniform_int_distribution<int> anyItem(0, config.items - 1);
+    vector<string> queries;
+    for (int i = 0; i < config.itemQueries; i++) {
+        string name = benchItemName(anyItem(rng));
+        size_t pos = rng() % name.size();
+        if (!fuzzy)
+            name.resize(pos + 1);
+        else if (rng() % 3 == 0)
+            name.erase(pos, 1);
+        else if (rng() % 2 == 0)
+            name[pos] = 'x';
+        else
+            name.insert(pos, 1, 'x');
+        queries.push_back(name);
+    }
+    refreshItemSearchIndex();  // Built once, like the first search in the program.
+    size_t matches = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for (const string &query : queries) {
+        BenchClock::time_point t = BenchClock::now();
+        matches += fuzzy ? itemsNear(query, fuzzyTolerance(query)).size() : itemsWithPrefix(query).size();
+        result.latencies.push_back(elapsedMicros(t));
+    }
+    result.seconds = elapsedMicros(start) / 1e6;
+    if (matches == 0)
+        cerr << "Warning: the " << result.name << " searches found nothing.\n";
+    return result;
+}
+
+BenchResult benchMetro(const BenchConfig &config) {
+    BenchResult result;
+    result.name = "updateMetroManilaData";
+    BenchClock::time_point start = BenchClock::now();
+    for (int round = 0; round < config.rounds; round++) {
+        BenchClock::time_point t = BenchClock::now();
+        updateMetroManilaData();
+        result.latencies.push_back(elapsedMicros(t));
+    }
+    result.seconds = elapsedMicros(start) / 1e6;
+    return result;
+}
+
+// Plans a rebalancing of every item toward the metro mean (without applying
+// it), once per round, on the planner's worker threads.
+BenchResult benchRebalance(const BenchConfig &config) {
+    BenchResult result;
+    result.name = "planRebalance";
+    RebalanceTargets targets = rebalanceTargets(false, DEFAULT_REBALANCE_TOLERANCE);
+    size_t transfers = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for (int round = 0; round < config.rounds; round++) {
+        BenchClock::time_point t = BenchClock::now();
+        for (auto &plan : planRebalance(targets, {}))
+            transfers += plan.transfers.size();
+        result.latencies.push_back(elapsedMicros(t));
+    }
+    result.seconds = elapsedMicros(start) / 1e6;
+    if (transfers == 0)
+        cerr << "Warning: the rebalancing plans moved nothing.\n";
+    return result;
+}
+
+// End-to-end allocations as a batch applies them: parse the request, pick the
+// largest donor, move the stock, patch the indexes and the Metro Manila data,
+// and commit the transaction's journal record before the next request.
+BenchResult benchAllocate(const BenchConfig &config, const BenchDataset &data, mt19937 &rng) {
+    BenchResult result;
+    result.name = "allocation";
+    uniform_int_distribution<int> anyCity(0, config.cities - 1), anyItem(0, config.items - 1), anyQty(1, 50);
+    vector<string> requests;
+    for (int i = 0; i < config.allocations; i++) {
+        requests.push_back(data.cities[anyCity(rng)] + " " + benchItemName(anyItem(rng)) + " " +
+                           to_string(anyQty(rng)));
+    }
+    int failed = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for (const string &request : requests) {
+        BenchClock::time_point t = BenchClock::now();
+        Transaction transaction;
+        if (applyBatchLine(request, transaction).empty())
+            logTransaction(transaction.donor, transaction.recipient, transaction.item, transaction.quantity);
+        else
+            failed++;
+        result.latencies.push_back(elapsedMicros(t));
+    }
+    result.seconds = elapsedMicros(start) / 1e6;
+    if (failed)
+        cerr << "Warning: " << failed << " allocations failed.\n";
+    return result;
+}
+
+#ifndef _WIN32
+// The service with the cities split over "shards" shard processes, each in
+// its own directory under "sharded_<shards>", fed by config.clients
+// connections at once. Four in five requests are allocations between two
+// random cities (across shards as often as the layout makes them); the rest
+// are QUERYs. The shards' startup, which exports and splits the dataset, is
+// not timed.
+BenchResult benchShardedService(const BenchConfig &config, const BenchDataset &data, int shards, unsigned seed) {
+    BenchResult result;
+    result.name = "sharded_service_" + to_string(shards);
+    string directory = "sharded_" + to_string(shards);
+    error_code err;
+    filesystem::remove_all(directory, err);
+    filesystem::create_directories(directory, err);
+    string cityList;
+    for (auto &city : data.cities) {
+        filesystem::copy_file(city + ".txt", directory + "/" + city + ".txt", err);
+        cityList += city + "\n";
+    }
+    writeFileAtomically(directory + "/registered_cities.txt", cityList);
+    string socketPath = filesystem::absolute(directory + "/sock").string();
+    pid_t pid = startProgram(config.relief, directory, {"--serve", socketPath, "--shards", to_string(shards)},
+                             directory + "/run.log");
+    int probe = -1;
+    for (int tries = 0; tries < SHARD_START_SECONDS * 20 && pid > 0 && probe == -1; tries++) {
+        probe = connectToSocket(socketPath);
+        if (probe == -1)
+            this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    if (probe == -1) {
+        cerr << "Error: the service with " << shards << " shard(s) did not start; see \"" << directory
+             << "/run.log\".\n";
+        if (pid > 0)
+            kill(pid, SIGTERM);
+        return result;
+    }
+
+    vector<vector<double>> latencies(config.clients);
+    atomic<int> failed(0);
+    auto client = [&](int c) {
+        mt19937 rng(seed + c);
+        uniform_int_distribution<int> anyCity(0, config.cities - 1), anyItem(0, config.items - 1), anyQty(1, 50),
+            anyKind(0, 4);
+        int fd = connectToSocket(socketPath);
+        string pending, reply;
+        for (int i = 0; i < config.serviceRequests && fd != -1; i++) {
+            int recipient = anyCity(rng), donor = anyCity(rng);
+            string request;
+            if (anyKind(rng) == 0 || donor == recipient)
+                request = "QUERY " + data.cities[recipient] + " " + benchItemName(anyItem(rng));
+            else
+                request = "ALLOCATE " + data.cities[recipient] + " " + benchItemName(anyItem(rng)) + " " +
+                          to_string(anyQty(rng)) + " " + data.cities[donor];
+            BenchClock::time_point t = BenchClock::now();
+            if (!writeAll(fd, request + "\n") || !readLine(fd, pending, reply))
+                break;
+            latencies[c].push_back(elapsedMicros(t));
+            // Running a donor out of an item is expected; anything else is not.
+            if (reply.compare(0, 2, "OK") != 0 && reply.find("does not have enough") == string::npos)
+                failed++;
+        }
+        if (fd != -1)
+            close(fd);
+    };
+    vector<thread> clients;
+    BenchClock::time_point start = BenchClock::now();
+    for (int c = 0; c < config.clients; c++)
+        clients.emplace_back(client, c);
+    for (auto &t : clients)
+        t.join();
+    result.seconds = elapsedMicros(start) / 1e6;
+    for (auto &v : latencies)
+        result.latencies.insert(result.latencies.end(), v.begin(), v.end());
+
+    string pending, reply;
+    writeAll(probe, "SHUTDOWN\n");
+    readLine(probe, pending, reply);
+    close(probe);
+    waitpid(pid, nullptr, 0);
+    if (failed > 0)
+        cerr << "Warning: " << failed << " requests to the service with " << shards << " shard(s) failed.\n";
+    if (result.latencies.size() < (size_t)config.clients * config.serviceRequests)
+        cerr << "Warning: the service with " << shards << " shard(s) dropped connections.\n";
+    return result;
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// Command line: [--dir <path>] [--cities N] [--items N] [--duplicates R]
+// [--sorted F] [--rounds N] [--searches N] [--item-queries N] [--allocations N]
+// [--seed N] [--relief <program>] [--shard-counts N,N,...] [--clients N]
+// [--service-requests N].
+// -----------------------------------------------------------------------------
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+    bool valid = true;
+    for (int i = 1; i < argc && valid; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            valid = false;  // Every option takes a value.
+            break;
+        }
+        string value = argv[++i];
+        if (arg == "--dir")
+            config.directory = value;
+        else if (arg == "--cities")
+            config.cities = atoi(value.c_str());
+        else if (arg == "--items")
+            config.items = atoi(value.c_str());
+        else if (arg == "--duplicates")
+            config.duplicateRate = atof(value.c_str());
+        else if (arg == "--sorted")
+            config.sortedness = atof(value.c_str());
+        else if (arg == "--rounds")
+            config.rounds = atoi(value.c_str());
+        else if (arg == "--searches")
+            config.searches = atoi(value.c_str());
+        else if (arg == "--item-queries")
+            config.itemQueries = atoi(value.c_str());
+        else if (arg == "--allocations")
+            config.allocations = atoi(value.c_str());
+        else if (arg == "--seed")
+            config.seed = (unsigned)atoi(value.c_str());
+        else if (arg == "--relief")
+            config.relief = filesystem::absolute(value).string();  // Before moving to the scratch directory.
+        else if (arg == "--shard-counts") {
+            config.shardCounts.clear();
+            istringstream counts(value);
+            string count;
+            while (getline(counts, count, ','))
+                config.shardCounts.push_back(atoi(count.c_str()));
+        } else if (arg == "--clients")
+            config.clients = atoi(value.c_str());
+        else if (arg == "--service-requests")
+            config.serviceRequests = atoi(value.c_str());
+        else
+            valid = false;
+    }
+    for (int shards : config.shardCounts)
+        valid = valid && shards >= 1 && shards <= MAX_SHARDS;
+    if (!valid || config.cities <= 0 || config.items <= 0 || config.rounds <= 0 || config.duplicateRate < 0 ||
+        config.clients <= 0) {
+        cerr << "Usage: " << argv[0] << " [--dir <path>] [--cities N] [--items N] [--duplicates R]"
+             << " [--sorted F] [--rounds N] [--searches N] [--item-queries N] [--allocations N] [--seed N]"
+             << " [--relief <program>] [--shard-counts N,N,...] [--clients N] [--service-requests N]\n";
+        return 1;
+    }
+
+    // Everything runs inside the scratch directory, which starts without a
+    // journal so each run appends to an empty one.
+    error_code err;
+    filesystem::create_directories(config.directory, err);
+    filesystem::current_path(config.directory, err);
+    if (err) {
+        cerr << "Error: cannot use directory \"" << config.directory << "\".\n";
+        return 1;
+    }
+    remove(JOURNAL_FILE);
+    remove(JOURNAL_INDEX_FILE);
+    remove("historical_transactions.txt");
+    cityMemoryBudget = numeric_limits<size_t>::max();
+
+    mt19937 rng(config.seed);
+    BenchDataset data = generateDataset(config, rng);
+    cout << "{\"config\":{\"cities\":" << config.cities << ",\"items\":" << config.items
+         << ",\"duplicates\":" << config.duplicateRate << ",\"sorted\":" << config.sortedness
+         << ",\"rounds\":" << config.rounds << ",\"searches\":" << config.searches
+         << ",\"item_queries\":" << config.itemQueries
+         << ",\"allocations\":" << config.allocations << ",\"seed\":" << config.seed
+         << ",\"clients\":" << config.clients << ",\"service_requests\":" << config.serviceRequests << "}}\n";
+
+    NullBuffer null;
+    streambuf *console = cout.rdbuf();
+    vector<BenchResult> results;
+    cout.rdbuf(&null);
+    results.push_back(benchLoad(config, data));
+    const string orders[] = {"file", "sorted", "reversed"};
+    for (const string &order : orders) {
+        results.push_back(benchSort(config, data, "quickSort", order, quickSort));
+        results.push_back(benchSort(config, data, "mergeSort", order, mergeSort));
+    }
+    results.push_back(benchSearch(config, data, rng));
+    results.push_back(benchItemSearch(config, rng, false));
+    results.push_back(benchItemSearch(config, rng, true));
+    results.push_back(benchMetro(config));
+    rebuildDonorIndex();
+    results.push_back(benchRebalance(config));
+    openJournal(JOURNAL_BUFFERED);
+    results.push_back(benchAllocate(config, data, rng));
+    closeJournal();
+    cout.rdbuf(console);
+#ifndef _WIN32
+    if (!config.relief.empty()) {
+        for (int shards : config.shardCounts)
+            results.push_back(benchShardedService(config, data, shards, config.seed));
+    }
+#endif
+
+    for (auto &result : results)
+        printResult(result);
+    return 0;
+}